@@ -67,7 +67,7 @@ static void free_filebuf(SEXP sbuf)
 }
 
 
-SEXP alloc_filebuf(SEXP sfile)
+SEXP alloc_filebuf(SEXP sfile, SEXP sindex)
 {
 	SEXP ans, sclass, shandle, snames;
 	struct corpus_filebuf *buf;
@@ -77,6 +77,11 @@ SEXP alloc_filebuf(SEXP sfile)
                 error("invalid 'file' argument");
         }
 
+	if (sindex != R_NilValue && !(isString(sindex)
+				      && LENGTH(sindex) == 1)) {
+		error("invalid 'index' argument");
+	}
+
 	file = R_ExpandFileName(CHAR(STRING_ELT(sfile, 0)));
 
 	PROTECT(shandle = R_MakeExternalPtr(NULL, FILEBUF_TAG, R_NilValue));
@@ -85,13 +90,15 @@ SEXP alloc_filebuf(SEXP sfile)
 	buf = filebuf_new(file);
 	R_SetExternalPtrAddr(shandle, buf);
 
-	PROTECT(ans = allocVector(VECSXP, 2));
+	PROTECT(ans = allocVector(VECSXP, 3));
 	SET_VECTOR_ELT(ans, 0, shandle);
 	SET_VECTOR_ELT(ans, 1, sfile);
+	SET_VECTOR_ELT(ans, 2, sindex);
 
-	PROTECT(snames = allocVector(STRSXP, 2));
+	PROTECT(snames = allocVector(STRSXP, 3));
 	SET_STRING_ELT(snames, 0, mkChar("handle"));
 	SET_STRING_ELT(snames, 1, mkChar("file"));
+	SET_STRING_ELT(snames, 2, mkChar("index"));
 	setAttrib(ans, R_NamesSymbol, snames);
 
 	PROTECT(sclass = allocVector(STRSXP, 1));
@@ -160,3 +167,4 @@ struct corpus_filebuf *as_filebuf(SEXP sbuf)
 
 	return buf;
 }
+
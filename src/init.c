@@ -41,29 +41,38 @@ static const R_CallMethodDef CallEntries[] = {
 	CALLDEF(length_text, 1),
 	CALLDEF(logging_off, 0),
 	CALLDEF(logging_on, 0),
-	CALLDEF(mmap_ndjson, 2),
+	CALLDEF(mmap_ndjson, 5),
 	CALLDEF(names_json, 1),
 	CALLDEF(names_text, 1),
 	CALLDEF(print_json, 1),
-	CALLDEF(read_ndjson, 2),
+	CALLDEF(read_ndjson_connection, 4),
+	CALLDEF(share_text_handle, 1),
 	CALLDEF(simplify_json, 1),
 	CALLDEF(stem_snowball, 2),
 	CALLDEF(stopwords, 1),
 	CALLDEF(subscript_json, 2),
 	CALLDEF(subset_json, 3),
-	CALLDEF(term_stats, 7),
-	CALLDEF(term_matrix, 4),
+	CALLDEF(subset_text_handle, 2),
+	CALLDEF(term_stats, 8),
+	CALLDEF(term_matrix, 6),
 	CALLDEF(text_c, 3),
-	CALLDEF(text_count, 2),
-	CALLDEF(text_detect, 2),
-	CALLDEF(text_locate, 2),
-	CALLDEF(text_match, 2),
+	CALLDEF(text_count, 5),
+	CALLDEF(text_detect, 5),
+	CALLDEF(text_dictionary, 7),
+	CALLDEF(text_index, 1),
+	CALLDEF(text_locate, 6),
+	CALLDEF(text_match, 5),
 	CALLDEF(text_nsentence, 1),
 	CALLDEF(text_ntoken, 1),
 	CALLDEF(text_ntype, 2),
+	CALLDEF(text_sample, 7),
 	CALLDEF(text_split_sentences, 2),
 	CALLDEF(text_split_tokens, 2),
+	CALLDEF(text_stats, 1),
 	CALLDEF(text_sub, 3),
+	CALLDEF(text_substring_count, 3),
+	CALLDEF(text_substring_index, 1),
+	CALLDEF(text_substring_locate, 3),
 	CALLDEF(text_trunc, 3),
 	CALLDEF(text_tokens, 1),
 	CALLDEF(text_types, 2),
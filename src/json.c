@@ -26,6 +26,13 @@
 
 #define JSON_TAG install("corpus::json")
 
+// marks the columns created by project_json, which get reloaded with the
+// field scanner instead of a full parse
+#define JSON_PROJECTED_ATTR install("corpus::projected")
+
+// type ID of a row subset, until the type gets computed from the rows
+#define JSON_TYPE_PENDING INT_MIN
+
 
 static SEXP subrows_json(SEXP sdata, SEXP si);
 static SEXP subfield_json(SEXP sdata, SEXP sname);
@@ -36,7 +43,10 @@ static void free_json(SEXP sjson)
         struct json *obj = R_ExternalPtrAddr(sjson);
         R_SetExternalPtrAddr(sjson, NULL);
 	if (obj) {
-		corpus_schema_destroy(&obj->schema);
+		if (obj->own_schema) {
+			corpus_schema_destroy(obj->schema);
+			corpus_free(obj->schema);
+		}
 		corpus_free(obj->rows);
 		corpus_free(obj);
 	}
@@ -83,8 +93,10 @@ SEXP alloc_json(SEXP sbuffer, SEXP sfield, SEXP srows, SEXP stext)
 	nprot++;
 	R_RegisterCFinalizerEx(shandle, free_json, TRUE);
 
-	TRY_ALLOC(obj = corpus_malloc(sizeof(*obj)));
-	TRY(corpus_schema_init(&obj->schema));
+	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+	TRY_ALLOC(obj->schema = corpus_malloc(sizeof(*obj->schema)));
+	TRY(corpus_schema_init(obj->schema));
+	obj->own_schema = 1;
 
 	obj->rows = NULL;
 	obj->nrow = 0;
@@ -114,7 +126,10 @@ SEXP alloc_json(SEXP sbuffer, SEXP sfield, SEXP srows, SEXP stext)
 	setAttrib(ans, R_ClassSymbol, sclass);
 
 out:
-	corpus_free(obj);
+	if (obj) {
+		corpus_free(obj->schema);
+		corpus_free(obj);
+	}
 	CHECK_ERROR(err);
 	UNPROTECT(nprot);
 	return ans;
@@ -138,7 +153,530 @@ out:
 }
 
 
-static void json_load(SEXP sdata)
+// minimum number of bytes for each parsing thread
+#define JSON_CHUNK_MIN (1 << 20)
+
+struct json_chunk {
+	struct corpus_schema schema;
+	const uint8_t *begin, *end;
+	struct corpus_data *rows;
+	R_xlen_t nrow;
+	int type_id;
+	int has_schema;
+	int error;
+};
+
+
+static R_xlen_t json_count_lines(const uint8_t *begin, const uint8_t *end)
+{
+	const uint8_t *ptr = begin;
+	R_xlen_t nline = 0;
+
+	while (ptr != end) {
+		ptr = memchr(ptr, '\n', (size_t)(end - ptr));
+		nline++;
+		if (!ptr) {
+			break;
+		}
+		ptr++;
+	}
+
+	return nline;
+}
+
+
+// parse the lines in a chunk, using the chunk's own schema;
+// runs without the R API; safe to call from a worker thread
+static int json_chunk_parse(struct json_chunk *chunk)
+{
+	const uint8_t *ptr, *line_end;
+	uint_fast8_t ch;
+	R_xlen_t i;
+	int err = 0, type_id = CORPUS_DATATYPE_NULL;
+
+	ptr = chunk->begin;
+
+	for (i = 0; i < chunk->nrow; i++) {
+		line_end = ptr;
+		do {
+			ch = *line_end++;
+		} while (ch != '\n' && line_end != chunk->end);
+
+		TRY(corpus_data_assign(&chunk->rows[i], &chunk->schema, ptr,
+				       (size_t)(line_end - ptr)));
+		TRY(corpus_schema_union(&chunk->schema, type_id,
+					chunk->rows[i].type_id, &type_id));
+		ptr = line_end;
+	}
+
+out:
+	chunk->type_id = type_id;
+	chunk->nrow = i; // on error, the index of the failing row
+	return err;
+}
+
+
+// add the types from 'src' to 'dst', setting map[t] to the ID in 'dst'
+// of type 't'; a type only refers to types with smaller IDs, so a single
+// pass in increasing order suffices
+static int json_schema_merge(struct corpus_schema *dst,
+			     const struct corpus_schema *src, int *map)
+{
+	const struct corpus_datatype *type;
+	const struct corpus_datatype_record *record;
+	const struct utf8lite_text *name;
+	int *type_ids, *name_ids;
+	int err = 0, i, t;
+
+	for (t = 0; t < src->ntype; t++) {
+		type = &src->types[t];
+
+		switch (type->kind) {
+		case CORPUS_DATATYPE_ARRAY:
+			i = type->meta.array.type_id;
+			TRY(corpus_schema_array(dst, i < 0 ? i : map[i],
+						type->meta.array.length,
+						&map[t]));
+			break;
+
+		case CORPUS_DATATYPE_RECORD:
+			record = &type->meta.record;
+			type_ids = (void *)R_alloc(record->nfield + 1,
+						   sizeof(*type_ids));
+			name_ids = (void *)R_alloc(record->nfield + 1,
+						   sizeof(*name_ids));
+
+			for (i = 0; i < record->nfield; i++) {
+				type_ids[i] = record->type_ids[i] < 0
+					? record->type_ids[i]
+					: map[record->type_ids[i]];
+				name = &src->names.types[record->name_ids[i]]
+					.text;
+				TRY(corpus_schema_name(dst, name,
+						       &name_ids[i]));
+			}
+
+			TRY(corpus_schema_record(dst, type_ids, name_ids,
+						 record->nfield, &map[t]));
+			break;
+
+		default: // atomic types have the same ID in every schema
+			map[t] = t;
+			break;
+		}
+	}
+
+out:
+	return err;
+}
+
+
+// split the data at line boundaries and parse the chunks in parallel,
+// then merge the chunk schemas into the parent's
+static void json_load_parallel(struct json *parent, const uint8_t *begin,
+			       const uint8_t *end, int nchunk,
+			       R_xlen_t *nrowptr, int *type_idptr)
+{
+	struct json_chunk *chunks;
+	struct json_chunk *chunk;
+	const uint8_t *ptr;
+	int *map;
+	R_xlen_t i, nrow;
+	size_t size = (size_t)(end - begin);
+	int err = 0, k, type_id;
+
+	chunks = (void *)R_alloc(nchunk, sizeof(*chunks));
+	memset(chunks, 0, nchunk * sizeof(*chunks));
+
+	// split at the first newline after each even division
+	ptr = begin;
+	for (k = 0; k < nchunk; k++) {
+		chunk = &chunks[k];
+		chunk->begin = ptr;
+
+		if (k + 1 == nchunk) {
+			ptr = end;
+		} else {
+			ptr = begin + (size_t)(((double)size * (k + 1))
+					       / nchunk);
+			if (ptr < chunk->begin) {
+				ptr = chunk->begin;
+			}
+			if (ptr != chunk->begin && ptr[-1] != '\n') {
+				ptr = memchr(ptr, '\n', (size_t)(end - ptr));
+				ptr = ptr ? ptr + 1 : end;
+			}
+		}
+		chunk->end = ptr;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nchunk) schedule(static, 1)
+#endif
+	for (k = 0; k < nchunk; k++) {
+		chunks[k].nrow = json_count_lines(chunks[k].begin,
+						  chunks[k].end);
+	}
+
+	nrow = 0;
+	for (k = 0; k < nchunk; k++) {
+		TRY(chunks[k].nrow > R_XLEN_T_MAX - nrow
+		    ? CORPUS_ERROR_OVERFLOW : 0);
+		nrow += chunks[k].nrow;
+	}
+
+	parent->rows = malloc_nonnull((size_t)nrow * sizeof(*parent->rows));
+
+	nrow = 0;
+	for (k = 0; k < nchunk; k++) {
+		chunk = &chunks[k];
+		chunk->rows = parent->rows + nrow;
+		nrow += chunk->nrow;
+
+		TRY(corpus_schema_init(&chunk->schema));
+		chunk->has_schema = 1;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nchunk) schedule(static, 1)
+#endif
+	for (k = 0; k < nchunk; k++) {
+		chunks[k].error = json_chunk_parse(&chunks[k]);
+	}
+
+	// report the first failing row
+	nrow = 0;
+	for (k = 0; k < nchunk; k++) {
+		if (chunks[k].error) {
+			nrow += chunks[k].nrow;
+			err = chunks[k].error;
+			goto out;
+		}
+		nrow += chunks[k].nrow;
+	}
+
+	// merge the schemas and convert the row types
+	type_id = CORPUS_DATATYPE_NULL;
+	for (k = 0; k < nchunk; k++) {
+		chunk = &chunks[k];
+		map = (void *)R_alloc(chunk->schema.ntype + 1, sizeof(*map));
+		TRY(json_schema_merge(parent->schema, &chunk->schema, map));
+
+		for (i = 0; i < chunk->nrow; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (chunk->rows[i].type_id >= 0) {
+				chunk->rows[i].type_id =
+					map[chunk->rows[i].type_id];
+			}
+		}
+
+		TRY(corpus_schema_union(parent->schema, type_id,
+					chunk->type_id < 0 ? chunk->type_id
+					: map[chunk->type_id], &type_id));
+
+		corpus_schema_destroy(&chunk->schema);
+		chunk->has_schema = 0;
+	}
+
+	*type_idptr = type_id;
+
+out:
+	for (k = 0; k < nchunk; k++) {
+		if (chunks[k].has_schema) {
+			corpus_schema_destroy(&chunks[k].schema);
+		}
+	}
+	*nrowptr = nrow;
+	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON data",
+			   (uint64_t)(nrow + 1));
+}
+
+
+/*
+ * Field projection. Rather than parsing a full row, we scan its bytes for
+ * the value at the end of a field path, skipping over the other fields
+ * without validating them, and parse only that value.
+ */
+
+struct json_path {
+	struct utf8lite_text *names;
+	int depth;
+};
+
+// stands in for a value that is missing from its row
+static const uint8_t json_null[] = "null";
+
+
+static void json_path_make(struct json_path *path, SEXP sfield_path)
+{
+	const char *name;
+	int err = 0, j;
+
+	path->depth = LENGTH(sfield_path);
+	path->names = (void *)R_alloc(path->depth, sizeof(*path->names));
+
+	for (j = 0; j < path->depth; j++) {
+		name = CHAR(STRING_ELT(sfield_path, j));
+		TRY(utf8lite_text_assign(&path->names[j], (const uint8_t *)name,
+					 strlen(name), 0, NULL));
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+static const uint8_t *json_skip_space(const uint8_t *ptr,
+				      const uint8_t *end)
+{
+	while (ptr != end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n'
+			      || *ptr == '\r')) {
+		ptr++;
+	}
+	return ptr;
+}
+
+
+// skip the string starting at 'ptr', an opening quote; returns NULL
+// if the string is unterminated
+static const uint8_t *json_skip_string(const uint8_t *ptr,
+				       const uint8_t *end)
+{
+	ptr++;
+	while (ptr != end) {
+		if (*ptr == '"') {
+			return ptr + 1;
+		} else if (*ptr == '\\') {
+			if (++ptr == end) {
+				break;
+			}
+		}
+		ptr++;
+	}
+	return NULL;
+}
+
+
+// skip the value starting at 'ptr'; returns NULL if the value is an
+// unterminated string, object, or array
+static const uint8_t *json_skip_value(const uint8_t *ptr,
+				      const uint8_t *end)
+{
+	int depth = 0;
+
+	if (*ptr == '"') {
+		return json_skip_string(ptr, end);
+	}
+
+	if (*ptr != '{' && *ptr != '[') {
+		// number or literal
+		while (ptr != end && *ptr != ',' && *ptr != '}' && *ptr != ']'
+		       && *ptr != ' ' && *ptr != '\t' && *ptr != '\n'
+		       && *ptr != '\r') {
+			ptr++;
+		}
+		return ptr;
+	}
+
+	while (ptr != end) {
+		switch (*ptr) {
+		case '"':
+			ptr = json_skip_string(ptr, end);
+			if (!ptr) {
+				return NULL;
+			}
+			continue;
+
+		case '{':
+		case '[':
+			depth++;
+			break;
+
+		case '}':
+		case ']':
+			if (--depth == 0) {
+				return ptr + 1;
+			}
+			break;
+
+		default:
+			break;
+		}
+		ptr++;
+	}
+
+	return NULL;
+}
+
+
+static int json_key_equals(const uint8_t *ptr, const uint8_t *end,
+			   const struct utf8lite_text *name)
+{
+	struct utf8lite_text key;
+	size_t size = (size_t)(end - ptr);
+
+	if (!memchr(ptr, '\\', size)) {
+		return (size == UTF8LITE_TEXT_SIZE(name)
+			&& memcmp(ptr, name->ptr, size) == 0);
+	}
+
+	// compare the decoded key
+	if (utf8lite_text_assign(&key, ptr, size, UTF8LITE_TEXT_UNESCAPE,
+				 NULL)) {
+		return 0;
+	}
+	return utf8lite_text_equals(&key, name);
+}
+
+
+// find the value of field 'name' in the record in [*ptrptr, *endptr),
+// updating the range to that of the value; sets *ptrptr to NULL if the
+// value is not a record or the field is missing
+static int json_find_field(const struct utf8lite_text *name,
+			   const uint8_t **ptrptr, const uint8_t **endptr)
+{
+	const uint8_t *ptr = *ptrptr, *end = *endptr, *key, *key_end, *val;
+	int err = 0;
+
+	*ptrptr = NULL;
+
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end || *ptr != '{') {
+		goto out;
+	}
+
+	ptr = json_skip_space(ptr + 1, end);
+	if (ptr != end && *ptr == '}') {
+		goto out;
+	}
+
+	while (1) {
+		TRY(ptr == end || *ptr != '"' ? CORPUS_ERROR_INVAL : 0);
+		key = ptr + 1;
+		ptr = json_skip_string(ptr, end);
+		TRY(ptr ? 0 : CORPUS_ERROR_INVAL);
+		key_end = ptr - 1;
+
+		ptr = json_skip_space(ptr, end);
+		TRY(ptr == end || *ptr != ':' ? CORPUS_ERROR_INVAL : 0);
+
+		ptr = json_skip_space(ptr + 1, end);
+		TRY(ptr == end ? CORPUS_ERROR_INVAL : 0);
+
+		val = ptr;
+		ptr = json_skip_value(ptr, end);
+		TRY(ptr ? 0 : CORPUS_ERROR_INVAL);
+
+		if (json_key_equals(key, key_end, name)) {
+			*ptrptr = val;
+			*endptr = ptr;
+			goto out;
+		}
+
+		ptr = json_skip_space(ptr, end);
+		TRY(ptr == end ? CORPUS_ERROR_INVAL : 0);
+		if (*ptr == '}') {
+			goto out;
+		}
+		TRY(*ptr != ',' ? CORPUS_ERROR_INVAL : 0);
+		ptr = json_skip_space(ptr + 1, end);
+	}
+out:
+	return err;
+}
+
+
+// fill the columns with the values at the ends of the field paths, one
+// for each line in [begin, end)
+static void json_project(struct json **cols, const struct json_path *paths,
+			 int ncol, const uint8_t *begin, const uint8_t *end)
+{
+	const uint8_t *ptr, *line_end, *val, *val_end;
+	R_xlen_t nrow, nrow_max, size;
+	int *type_ids;
+	int err = 0, j, k;
+
+	type_ids = (void *)R_alloc(ncol, sizeof(*type_ids));
+	for (k = 0; k < ncol; k++) {
+		type_ids[k] = CORPUS_DATATYPE_NULL;
+	}
+
+	nrow = 0;
+	nrow_max = 0;
+	ptr = begin;
+
+	while (ptr != end) {
+		RCORPUS_CHECK_INTERRUPT(nrow);
+
+		if (nrow == nrow_max) {
+			size = nrow_max;
+			for (k = 0; k < ncol; k++) {
+				size = nrow_max;
+				grow_datarows(&cols[k]->rows, &size);
+			}
+			nrow_max = size;
+		}
+
+		line_end = memchr(ptr, '\n', (size_t)(end - ptr));
+		line_end = line_end ? line_end + 1 : end;
+
+		for (k = 0; k < ncol; k++) {
+			val = ptr;
+			val_end = line_end;
+			for (j = 0; j < paths[k].depth && val; j++) {
+				TRY(json_find_field(&paths[k].names[j], &val,
+						    &val_end));
+			}
+			if (!val) {
+				val = json_null;
+				val_end = json_null + sizeof(json_null) - 1;
+			}
+
+			TRY(corpus_data_assign(&cols[k]->rows[nrow],
+					       cols[k]->schema, val,
+					       (size_t)(val_end - val)));
+			TRY(corpus_schema_union(cols[k]->schema, type_ids[k],
+						cols[k]->rows[nrow].type_id,
+						&type_ids[k]));
+		}
+
+		nrow++;
+		ptr = line_end;
+	}
+
+	for (k = 0; k < ncol; k++) {
+		// free excess memory, ensuring result is non-NULL
+		cols[k]->rows = realloc_nonnull(cols[k]->rows,
+						nrow * sizeof(*cols[k]->rows));
+		cols[k]->nrow = nrow;
+		cols[k]->type_id = type_ids[k];
+		cols[k]->kind = (type_ids[k] < 0 ? CORPUS_DATATYPE_ANY
+				 : cols[k]->schema->types[type_ids[k]].kind);
+	}
+
+out:
+	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON data",
+			   (uint64_t)(nrow + 1));
+}
+
+
+// get the bytes of a raw vector or file buffer
+static void json_buffer(SEXP sbuffer, const uint8_t **beginptr,
+			const uint8_t **endptr)
+{
+	struct corpus_filebuf *buf;
+
+	if (is_filebuf(sbuffer)) {
+		buf = as_filebuf(sbuffer);
+		*beginptr = buf->map_addr;
+		*endptr = *beginptr + buf->map_size;
+	} else {
+		*beginptr = (const uint8_t *)RAW(sbuffer);
+		*endptr = *beginptr + XLENGTH(sbuffer);
+	}
+}
+
+
+static void json_load(SEXP sdata, int nthread)
 {
 	SEXP shandle, sparent_handle, sbuffer, sfield, stext, sfield_path,
 	     srows, sparent, sparent2;
@@ -148,8 +686,9 @@ static void json_load(SEXP sdata)
 	const uint8_t *ptr, *begin, *line_end, *end;
 	uint_fast8_t ch;
 	size_t size;
+	struct json_path path;
 	R_xlen_t nrow, nrow_max, j, m;
-	int err = 0, type_id;
+	int err = 0, indexed = 0, projected, type_id;
 
 	shandle = getListElement(sdata, "handle");
 	obj = R_ExternalPtrAddr(shandle);
@@ -170,9 +709,35 @@ static void json_load(SEXP sdata)
 	nrow = 0;
 	nrow_max = 0;
 
-	if (is_filebuf(sbuffer)) {
-		buf = as_filebuf(sbuffer);
+	buf = is_filebuf(sbuffer) ? as_filebuf(sbuffer) : NULL;
+	json_buffer(sbuffer, &begin, &end);
+
+	// use at most one thread per JSON_CHUNK_MIN bytes
+	size = (size_t)(end - begin);
+	if (nthread > 1 && (size_t)nthread > size / JSON_CHUNK_MIN) {
+		nthread = (int)(size / JSON_CHUNK_MIN);
+	}
 
+	srows = getListElement(sdata, "rows");
+	sfield_path = getListElement(sdata, "field");
+
+	projected = (srows == R_NilValue && sfield_path != R_NilValue
+		     && getAttrib(sdata, JSON_PROJECTED_ATTR) != R_NilValue);
+
+	if (projected) {
+		// a projected column; scan for the field values only
+		json_path_make(&path, sfield_path);
+		json_project(&parent, &path, 1, begin, end);
+		nrow = parent->nrow;
+		type_id = parent->type_id;
+	} else if (buf && json_index_load(parent, sbuffer)) {
+		indexed = 1;
+		nrow = parent->nrow;
+		type_id = parent->type_id;
+	} else if (nthread > 1) {
+		json_load_parallel(parent, begin, end, nthread, &nrow,
+				   &type_id);
+	} else if (buf) {
 		corpus_filebuf_iter_make(&it, buf);
 		while (corpus_filebuf_iter_advance(&it)) {
 			RCORPUS_CHECK_INTERRUPT(nrow);
@@ -185,17 +750,15 @@ static void json_load(SEXP sdata)
 			size = it.current.size;
 
 			TRY(corpus_data_assign(&parent->rows[nrow],
-					       &parent->schema, ptr, size));
+					       parent->schema, ptr, size));
 
-			TRY(corpus_schema_union(&parent->schema, type_id,
+			TRY(corpus_schema_union(parent->schema, type_id,
 						parent->rows[nrow].type_id,
 						&type_id));
 			nrow++;
 		}
 	} else {
 		// parse data from buffer
-		begin = (const uint8_t *)RAW(sbuffer);
-		end = begin + XLENGTH(sbuffer);
 		ptr = begin;
 
 		while (ptr != end) {
@@ -213,9 +776,9 @@ static void json_load(SEXP sdata)
 			size = (size_t)(line_end - ptr);
 
 			TRY(corpus_data_assign(&parent->rows[nrow],
-					       &parent->schema, ptr, size));
+					       parent->schema, ptr, size));
 
-			TRY(corpus_schema_union(&parent->schema, type_id,
+			TRY(corpus_schema_union(parent->schema, type_id,
 						parent->rows[nrow].type_id,
 						&type_id));
 			nrow++;
@@ -231,21 +794,24 @@ static void json_load(SEXP sdata)
 	parent->nrow = nrow;
 	parent->type_id = type_id;
 	parent->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
-				    : parent->schema.types[type_id].kind);
+				    : parent->schema->types[type_id].kind);
+
+	if (buf && !indexed && !projected) {
+		json_index_save(parent, sbuffer);
+	}
 
 	// first extract the rows from the parent...
-	srows = getListElement(sdata, "rows");
 	if (srows != R_NilValue) {
+		// the subset shares the parent's schema, keeping the parent
+		// alive, so do not free the parent
 		PROTECT(sparent2 = subrows_json(sparent, srows));
-		free_json(sparent_handle);
 		UNPROTECT(2);
 		PROTECT(sparent = sparent2);
 		sparent_handle = getListElement(sparent, "handle");
 	}
 
 	// ...then extract the field
-	sfield_path = getListElement(sdata, "field");
-	if (sfield_path != R_NilValue) {
+	if (sfield_path != R_NilValue && !projected) {
 		m = XLENGTH(sfield_path);
 		for (j = 0; j < m; j++) {
 			sfield = STRING_ELT(sfield_path, j);
@@ -257,11 +823,13 @@ static void json_load(SEXP sdata)
 		}
 	}
 
-	// steal the handle from the parent
+	// steal the handle from the parent, along with the schema owner
 	obj = R_ExternalPtrAddr(sparent_handle);
 	R_SetExternalPtrAddr(sparent_handle, NULL);
 	free_json(shandle);
 	R_SetExternalPtrAddr(shandle, obj);
+	R_SetExternalPtrProtected(shandle,
+				  R_ExternalPtrProtected(sparent_handle));
 
 out:
 	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON data",
@@ -270,6 +838,38 @@ out:
 }
 
 
+SEXP project_json(SEXP sbuffer, SEXP sfields, SEXP stext)
+{
+	SEXP ans, scol;
+	struct json **cols;
+	struct json_path *paths;
+	const uint8_t *begin, *end;
+	int k, ncol;
+
+	ncol = LENGTH(sfields);
+	cols = (void *)R_alloc(ncol, sizeof(*cols));
+	paths = (void *)R_alloc(ncol, sizeof(*paths));
+
+	PROTECT(ans = allocVector(VECSXP, ncol));
+	for (k = 0; k < ncol; k++) {
+		scol = alloc_json(sbuffer, VECTOR_ELT(sfields, k), R_NilValue,
+				  stext);
+		SET_VECTOR_ELT(ans, k, scol);
+		setAttrib(scol, JSON_PROJECTED_ATTR, ScalarLogical(TRUE));
+		cols[k] = R_ExternalPtrAddr(getListElement(scol, "handle"));
+		json_path_make(&paths[k], VECTOR_ELT(sfields, k));
+	}
+
+	json_buffer(sbuffer, &begin, &end);
+
+	// scan the data once, for all of the columns
+	json_project(cols, paths, ncol, begin, end);
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
 int is_json(SEXP sdata)
 {
 	SEXP handle, buffer;
@@ -293,24 +893,66 @@ int is_json(SEXP sdata)
 }
 
 
-struct json *as_json(SEXP sdata)
+// compute the type of a row subset from the types of its rows
+static void json_resolve_type(struct json *obj)
+{
+	R_xlen_t i;
+	int err = 0, type_id;
+
+	if (obj->type_id != JSON_TYPE_PENDING) {
+		return;
+	}
+
+	type_id = CORPUS_DATATYPE_NULL;
+	for (i = 0; i < obj->nrow; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		TRY(corpus_schema_union(obj->schema, type_id,
+					obj->rows[i].type_id, &type_id));
+	}
+
+	obj->type_id = type_id;
+	obj->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
+				 : obj->schema->types[type_id].kind);
+out:
+	CHECK_ERROR(err);
+}
+
+
+// get the object with its rows loaded, but possibly without its type
+static struct json *json_get(SEXP sdata)
 {
 	SEXP shandle;
-	struct json *obj;
 
 	if (!is_json(sdata)) {
 		error("invalid JSON object");
 	}
 
-	json_load(sdata);
+	json_load(sdata, 1);
 
 	shandle = getListElement(sdata, "handle");
-	obj = R_ExternalPtrAddr(shandle);
+	return R_ExternalPtrAddr(shandle);
+}
+
 
+struct json *as_json(SEXP sdata)
+{
+	struct json *obj = json_get(sdata);
+
+	json_resolve_type(obj);
 	return obj;
 }
 
 
+void load_json(SEXP sdata, SEXP sthreads)
+{
+	if (!is_json(sdata)) {
+		error("invalid JSON object");
+	}
+
+	json_load(sdata, as_nthread(sthreads, R_XLEN_T_MAX));
+}
+
+
 SEXP dim_json(SEXP sdata)
 {
 	SEXP dims;
@@ -322,7 +964,7 @@ SEXP dim_json(SEXP sdata)
 		return R_NilValue;
 	}
 
-	t = &d->schema.types[d->type_id];
+	t = &d->schema->types[d->type_id];
 	r = &t->meta.record;
 
 	if (d->nrow > INT_MAX) {
@@ -347,7 +989,7 @@ SEXP length_json(SEXP sdata)
 	const struct corpus_datatype_record *r;
 
 	if (d->kind == CORPUS_DATATYPE_RECORD) {
-		t = &d->schema.types[d->type_id];
+		t = &d->schema->types[d->type_id];
 		r = &t->meta.record;
 		return ScalarInteger(r->nfield);
 	}
@@ -373,14 +1015,14 @@ SEXP names_json(SEXP sdata)
 		return R_NilValue;
 	}
 
-	t = &d->schema.types[d->type_id];
+	t = &d->schema->types[d->type_id];
 	r = &t->meta.record;
 
 	PROTECT(names = allocVector(STRSXP, r->nfield));
 	for (i = 0; i < r->nfield; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
-		name = &d->schema.names.types[r->name_ids[i]].text;
+		name = &d->schema->names.types[r->name_ids[i]].text;
 		str = mkCharLenCE((char *)name->ptr,
 				  UTF8LITE_TEXT_SIZE(name), CE_UTF8);
 		SET_STRING_ELT(names, i, str);
@@ -400,7 +1042,7 @@ SEXP print_json(SEXP sdata)
 	TRY(utf8lite_render_init(&r, UTF8LITE_ESCAPE_CONTROL));
 	has_render = 1;
 
-	corpus_render_datatype(&r, &d->schema, d->type_id);
+	corpus_render_datatype(&r, d->schema, d->type_id);
 	TRY(r.error);
 
 	if (d->kind == CORPUS_DATATYPE_RECORD) {
@@ -425,7 +1067,7 @@ SEXP subscript_json(SEXP sdata, SEXP si)
 {
 	SEXP ans, sname;
 	const struct json *d = as_json(sdata);
-	const struct corpus_schema *s = &d->schema;
+	const struct corpus_schema *s = d->schema;
 	const struct corpus_datatype *t;
 	const struct corpus_datatype_record *r;
 	const struct utf8lite_text *name;
@@ -440,7 +1082,7 @@ SEXP subscript_json(SEXP sdata, SEXP si)
 	if (d->kind != CORPUS_DATATYPE_RECORD) {
 		ans = subrows_json(sdata, si);
 	} else {
-		t = &d->schema.types[d->type_id];
+		t = &d->schema->types[d->type_id];
 		r = &t->meta.record;
 
 		if (!(1 <= i && i <= r->nfield)) {
@@ -462,20 +1104,18 @@ SEXP subscript_json(SEXP sdata, SEXP si)
 
 SEXP subrows_json(SEXP sdata, SEXP si)
 {
-	SEXP ans, shandle, sbuffer, sfield, srows, stext, srows2;
-	const struct json *obj = as_json(sdata);
+	SEXP ans, shandle, sowner, sbuffer, sfield, srows, stext, srows2;
+	const struct json *obj;
 	struct json *obj2;
-	const struct corpus_data *src;
 	const double *index;
 	double *irows;
 	R_xlen_t i, n, ind;
-	int type_id;
-	int err = 0;
 
 	if (si == R_NilValue) {
 		return sdata;
 	}
 
+	obj = json_get(sdata);
 	index = REAL(si);
 	n = XLENGTH(si);
 
@@ -491,8 +1131,20 @@ SEXP subrows_json(SEXP sdata, SEXP si)
 	shandle = getListElement(ans, "handle");
 	obj2 = R_ExternalPtrAddr(shandle);
 
+	// share the schema, keeping its owner alive in the protected slot
+	sowner = R_ExternalPtrProtected(getListElement(sdata, "handle"));
+	if (sowner == R_NilValue) {
+		sowner = getListElement(sdata, "handle");
+	}
+	R_SetExternalPtrProtected(shandle, sowner);
+
+	corpus_schema_destroy(obj2->schema);
+	corpus_free(obj2->schema);
+	obj2->schema = obj->schema;
+	obj2->own_schema = 0;
+
+	// copy the parsed rows; their types refer to the shared schema
 	obj2->rows = malloc_nonnull(n * sizeof(*obj2->rows));
-	type_id = CORPUS_DATATYPE_NULL;
 
 	for (i = 0; i < n; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
@@ -507,23 +1159,14 @@ SEXP subrows_json(SEXP sdata, SEXP si)
 		} else {
 			irows[i] = REAL(srows)[ind];
 		}
-		src = &obj->rows[ind];
-
-		TRY(corpus_data_assign(&obj2->rows[i], &obj2->schema,
-				       src->ptr, src->size));
-
-		TRY(corpus_schema_union(&obj2->schema, type_id,
-					obj2->rows[i].type_id, &type_id));
+		obj2->rows[i] = obj->rows[ind];
 	}
 
-	// set the fields
+	// defer computing the type until it is needed
 	obj2->nrow = n;
-	obj2->type_id = type_id;
-	obj2->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
-				  : obj2->schema.types[type_id].kind);
-out:
-	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON file",
-			   (uint64_t)(irows[i] + 1));
+	obj2->type_id = JSON_TYPE_PENDING;
+	obj2->kind = CORPUS_DATATYPE_ANY;
+
 	UNPROTECT(2);
 	return ans;
 }
@@ -532,7 +1175,7 @@ out:
 SEXP subfield_json(SEXP sdata, SEXP sname)
 {
 	SEXP ans, sbuffer, sfield, sfield2, shandle, srows, stext;
-	const struct json *obj = as_json(sdata);
+	const struct json *obj = json_get(sdata);
 	struct utf8lite_text name;
 	struct corpus_data field;
 	const char *name_ptr;
@@ -553,7 +1196,7 @@ SEXP subfield_json(SEXP sdata, SEXP sname)
 	TRY(utf8lite_text_assign(&name, (uint8_t *)name_ptr, name_len, 0,
 				 NULL));
 
-	if (!corpus_symtab_has_type(&obj->schema.names, &name, &name_id)) {
+	if (!corpus_symtab_has_type(&obj->schema->names, &name, &name_id)) {
 		UNPROTECT(nprot);
 		return R_NilValue;
 	}
@@ -588,20 +1231,20 @@ SEXP subfield_json(SEXP sdata, SEXP sname)
 		RCORPUS_CHECK_INTERRUPT(i);
 
 		// fails if the field is null
-		corpus_data_field(&obj->rows[i], &obj->schema, name_id,
+		corpus_data_field(&obj->rows[i], obj->schema, name_id,
 				  &field);
 
-		TRY(corpus_data_assign(&obj2->rows[i], &obj2->schema,
+		TRY(corpus_data_assign(&obj2->rows[i], obj2->schema,
 				       field.ptr, field.size));
 
-		TRY(corpus_schema_union(&obj2->schema, type_id,
+		TRY(corpus_schema_union(obj2->schema, type_id,
 					obj2->rows[i].type_id, &type_id));
 	}
 
 	obj2->nrow = n;
 	obj2->type_id = type_id;
 	obj2->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
-				  : obj2->schema.types[type_id].kind);
+				  : obj2->schema->types[type_id].kind);
 	err = 0;
 out:
 	CHECK_ERROR(err);
@@ -834,7 +1477,7 @@ static SEXP as_list_json_record(SEXP sdata)
 
 	assert(d->kind == CORPUS_DATATYPE_RECORD);
 
-	r = &d->schema.types[d->type_id].meta.record;
+	r = &d->schema->types[d->type_id].meta.record;
 	nfield = r->nfield;
 
 	sbuffer = getListElement(sdata, "buffer");
@@ -846,7 +1489,7 @@ static SEXP as_list_json_record(SEXP sdata)
 	PROTECT(ans = allocVector(VECSXP, r->nfield));
 	setAttrib(ans, R_NamesSymbol, names);
 	rows = (struct corpus_data **)R_alloc(nfield, sizeof(*rows));
-	cols = (int *)R_alloc(d->schema.names.ntype, sizeof(*cols));
+	cols = (int *)R_alloc(d->schema->names.ntype, sizeof(*cols));
 	schema = (struct corpus_schema **)R_alloc(nfield, sizeof(*schema));
 	type_id = (int *)R_alloc(nfield, sizeof(type_id));
 
@@ -874,14 +1517,14 @@ static SEXP as_list_json_record(SEXP sdata)
 		rows[j] = calloc_nonnull(n, sizeof(*rows[j]));
 		d_j->rows = rows[j];
 		d_j->nrow = n;
-		schema[j] = &d_j->schema;
+		schema[j] = d_j->schema;
 		type_id[j] = CORPUS_DATATYPE_NULL;
 	}
 
 	for (i = 0; i < n; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
-		if ((err = corpus_data_fields(&d->rows[i], &d->schema, &it))) {
+		if ((err = corpus_data_fields(&d->rows[i], d->schema, &it))) {
 			// record is null
 			continue;
 		}
@@ -943,7 +1586,7 @@ SEXP as_list_json(SEXP sdata)
 		if (d->type_id != CORPUS_DATATYPE_ANY) {
 			data.type_id = d->type_id; // promote the type
 		}
-		val = decode_sexp(&decode, &data, &d->schema);
+		val = decode_sexp(&decode, &data, d->schema);
 		SET_VECTOR_ELT(ans, i, val);
 	}
 
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "rcorpus.h"
+#include <R_ext/Utils.h>
+
+/*
+ * An index file stores the parsed state of an NDJSON file, so that the
+ * data can be reopened without parsing every row. All values use the
+ * native byte order; a byte order mark guards against moving the index to
+ * a platform with a different one.
+ *
+ *   header:  magic[8], byte order mark (uint32), version (uint32),
+ *            file size (uint64), file mtime (int64), file mtime
+ *            nanoseconds (int64), file inode (uint64), nrow (uint64),
+ *            type_id (int32), nname (int32), ntype (int32), pad (int32)
+ *   names:   nname x { attr (uint64), bytes, padded to 8 }
+ *   types:   ntype x { kind (int32), then for arrays the item type and
+ *            length (int32); for records, nfield (int32) and then
+ *            nfield x { type id, name id } (int32) }, padded to 8
+ *   rows:    nrow x { offset (uint64), size (uint64), type id (int64) }
+ *
+ * The index is only valid while the file's size, modification time, and
+ * inode all match the header. Platforms without sub-second times or
+ * inodes store 0 for them.
+ */
+
+#define JSON_INDEX_MAGIC "CRPSIDX1"
+#define JSON_INDEX_BOM 0x01020304u
+#define JSON_INDEX_VERSION 2u
+
+struct json_index_header {
+	char magic[8];
+	uint32_t bom;
+	uint32_t version;
+	uint64_t file_size;
+	int64_t file_mtime;
+	int64_t file_mtime_nsec;
+	uint64_t file_inode;
+	uint64_t nrow;
+	int32_t type_id;
+	int32_t nname;
+	int32_t ntype;
+	int32_t pad;
+};
+
+struct json_index_row {
+	uint64_t offset;
+	uint64_t size;
+	int64_t type_id;
+};
+
+struct json_index_reader {
+	const uint8_t *ptr;
+	const uint8_t *end;
+};
+
+
+// fill in the header fields that identify the version of the file
+static int json_index_stat(const char *file,
+			   struct json_index_header *header)
+{
+	struct stat st;
+
+	if (stat(file, &st) != 0) {
+		return errno ? errno : -1;
+	}
+
+	header->file_size = (uint64_t)st.st_size;
+	header->file_mtime = (int64_t)st.st_mtime;
+#if defined(_WIN32) || defined(_WIN64)
+	header->file_mtime_nsec = 0;
+	header->file_inode = 0;
+#elif defined(__APPLE__)
+	header->file_mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec;
+	header->file_inode = (uint64_t)st.st_ino;
+#else
+	header->file_mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+	header->file_inode = (uint64_t)st.st_ino;
+#endif
+	return 0;
+}
+
+
+// expand a file name; R_ExpandFileName can return a static buffer that
+// the next call overwrites, so return a copy
+static const char *json_index_expand(SEXP sname)
+{
+	const char *name = R_ExpandFileName(CHAR(STRING_ELT(sname, 0)));
+	char *ans = R_alloc(strlen(name) + 1, 1);
+
+	strcpy(ans, name);
+	return ans;
+}
+
+
+static size_t pad8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+
+// get the next 'size' bytes, or NULL if the index is truncated
+static const void *reader_take(struct json_index_reader *r, size_t size)
+{
+	const void *ans;
+
+	if ((size_t)(r->end - r->ptr) < size) {
+		return NULL;
+	}
+
+	ans = r->ptr;
+	r->ptr += size;
+	return ans;
+}
+
+
+static int reader_int32(struct json_index_reader *r, int32_t *valptr)
+{
+	const void *ptr;
+
+	if (!(ptr = reader_take(r, sizeof(*valptr)))) {
+		return 0;
+	}
+	memcpy(valptr, ptr, sizeof(*valptr));
+	return 1;
+}
+
+
+// rebuild the schema types, setting map[t] to the new ID of type 't'
+static int json_index_read_types(struct json_index_reader *r,
+				 struct corpus_schema *schema,
+				 const int *name_map, int nname,
+				 int *map, int ntype)
+{
+	const uint8_t *begin = r->ptr;
+	int32_t kind, item, length, nfield, id;
+	int *type_ids, *name_ids;
+	int i, t;
+
+	for (t = 0; t < ntype; t++) {
+		if (!reader_int32(r, &kind)) {
+			return 0;
+		}
+
+		switch (kind) {
+		case CORPUS_DATATYPE_ARRAY:
+			if (!reader_int32(r, &item)
+					|| !reader_int32(r, &length)
+					|| item >= t) {
+				return 0;
+			}
+			if (corpus_schema_array(schema, item < 0 ? item
+						: map[item], length,
+						&map[t])) {
+				return 0;
+			}
+			break;
+
+		case CORPUS_DATATYPE_RECORD:
+			if (!reader_int32(r, &nfield) || nfield < 0) {
+				return 0;
+			}
+			type_ids = (void *)R_alloc(nfield + 1,
+						   sizeof(*type_ids));
+			name_ids = (void *)R_alloc(nfield + 1,
+						   sizeof(*name_ids));
+			for (i = 0; i < nfield; i++) {
+				if (!reader_int32(r, &id) || id >= t) {
+					return 0;
+				}
+				type_ids[i] = id < 0 ? id : map[id];
+
+				if (!reader_int32(r, &id) || id < 0
+						|| id >= nname) {
+					return 0;
+				}
+				name_ids[i] = name_map[id];
+			}
+			if (corpus_schema_record(schema, type_ids, name_ids,
+						 nfield, &map[t])) {
+				return 0;
+			}
+			break;
+
+		default:
+			if (kind < 0 || kind >= CORPUS_DATATYPE_ARRAY) {
+				return 0;
+			}
+			map[t] = t;
+			break;
+		}
+	}
+
+	return reader_take(r, pad8((size_t)(r->ptr - begin))
+			      - (size_t)(r->ptr - begin)) != NULL;
+}
+
+
+// load the rows and schema from the index, if it exists and is up to
+// date; returns non-zero on success
+int json_index_load(struct json *obj, SEXP sbuffer)
+{
+	SEXP sindex;
+	struct corpus_filebuf *buf, index;
+	struct json_index_reader r;
+	struct json_index_header current, header;
+	struct json_index_row row;
+	struct utf8lite_text name;
+	const char *file, *path;
+	const void *ptr;
+	uint64_t attr;
+	int *name_map, *map;
+	R_xlen_t i, nrow;
+	int err = 0, ok = 0, k, type_id;
+
+	sindex = getListElement(sbuffer, "index");
+	if (sindex == R_NilValue) {
+		return 0;
+	}
+
+	buf = as_filebuf(sbuffer);
+	file = json_index_expand(getListElement(sbuffer, "file"));
+	if (json_index_stat(file, &current)) {
+		return 0;
+	}
+
+	path = json_index_expand(sindex);
+	if (corpus_filebuf_init(&index, path)) {
+		return 0;
+	}
+
+	r.ptr = index.map_addr;
+	r.end = r.ptr + index.map_size;
+
+	if (!(ptr = reader_take(&r, sizeof(header)))) {
+		goto out;
+	}
+	memcpy(&header, ptr, sizeof(header));
+
+	if (memcmp(header.magic, JSON_INDEX_MAGIC, sizeof(header.magic))
+			|| header.bom != JSON_INDEX_BOM
+			|| header.version != JSON_INDEX_VERSION
+			|| header.file_size != current.file_size
+			|| header.file_size != (uint64_t)buf->map_size
+			|| header.file_mtime != current.file_mtime
+			|| header.file_mtime_nsec != current.file_mtime_nsec
+			|| header.file_inode != current.file_inode
+			|| header.nrow > (uint64_t)R_XLEN_T_MAX
+			|| header.nname < 0 || header.ntype < 0) {
+		goto out;
+	}
+	nrow = (R_xlen_t)header.nrow;
+
+	name_map = (void *)R_alloc(header.nname + 1, sizeof(*name_map));
+	for (k = 0; k < header.nname; k++) {
+		if (!(ptr = reader_take(&r, sizeof(attr)))) {
+			goto out;
+		}
+		memcpy(&attr, ptr, sizeof(attr));
+
+		name.attr = (size_t)attr;
+		ptr = reader_take(&r, pad8(UTF8LITE_TEXT_SIZE(&name)));
+		if (!ptr) {
+			goto out;
+		}
+		name.ptr = (uint8_t *)ptr;
+
+		if (corpus_schema_name(obj->schema, &name, &name_map[k])) {
+			goto out;
+		}
+	}
+
+	map = (void *)R_alloc(header.ntype + 1, sizeof(*map));
+	if (!json_index_read_types(&r, obj->schema, name_map, header.nname,
+				   map, header.ntype)) {
+		goto out;
+	}
+
+	if ((uint64_t)(r.end - r.ptr) / sizeof(row) < header.nrow) {
+		goto out;
+	}
+
+	obj->rows = corpus_malloc((nrow ? nrow : 1) * sizeof(*obj->rows));
+	if (!obj->rows) {
+		goto out;
+	}
+
+	for (i = 0; i < nrow; i++) {
+		memcpy(&row, reader_take(&r, sizeof(row)), sizeof(row));
+		if (row.offset > header.file_size
+				|| row.size > header.file_size - row.offset
+				|| row.type_id >= header.ntype) {
+			goto out;
+		}
+
+		obj->rows[i].ptr = buf->map_addr + row.offset;
+		obj->rows[i].size = (size_t)row.size;
+		obj->rows[i].type_id = (row.type_id < 0 ? (int)row.type_id
+					: map[row.type_id]);
+	}
+
+	type_id = header.type_id;
+	if (type_id >= header.ntype) {
+		goto out;
+	}
+
+	obj->nrow = nrow;
+	obj->type_id = type_id < 0 ? type_id : map[type_id];
+	obj->kind = (obj->type_id < 0 ? CORPUS_DATATYPE_ANY
+		     : obj->schema->types[obj->type_id].kind);
+	ok = 1;
+
+out:
+	corpus_filebuf_destroy(&index);
+
+	if (!ok) {
+		// start over with an empty schema
+		corpus_free(obj->rows);
+		obj->rows = NULL;
+		corpus_schema_destroy(obj->schema);
+		TRY(corpus_schema_init(obj->schema));
+	}
+	CHECK_ERROR(err);
+	return ok;
+}
+
+
+// pad a section of 'size' bytes to a multiple of 8
+static int write_pad(FILE *stream, size_t size)
+{
+	static const uint8_t zero[8] = { 0 };
+	size_t pad = pad8(size) - size;
+
+	return pad == 0 || fwrite(zero, 1, pad, stream) == pad;
+}
+
+
+static int write_all(FILE *stream, const void *ptr, size_t size)
+{
+	if (size && fwrite(ptr, 1, size, stream) != size) {
+		return 0;
+	}
+	return write_pad(stream, size);
+}
+
+
+static int write_int32(FILE *stream, int32_t val)
+{
+	return fwrite(&val, sizeof(val), 1, stream) == 1;
+}
+
+
+// a temporary file name in the same directory as 'path', so that it
+// can be renamed into place; free with R_free_tmpnam
+static char *json_index_tmpnam(const char *path)
+{
+	const char *base = path, *ptr;
+	char *dir;
+	size_t len;
+
+	for (ptr = path; *ptr; ptr++) {
+#if defined(_WIN32) || defined(_WIN64)
+		if (*ptr == '\\') {
+			base = ptr + 1;
+		}
+#endif
+		if (*ptr == '/') {
+			base = ptr + 1;
+		}
+	}
+
+	if (base == path) {
+		return R_tmpnam2(base, ".", ".tmp");
+	}
+
+	len = (size_t)(base - path - 1);
+	if (len == 0) { // the root directory
+		len = 1;
+	}
+	dir = R_alloc(len + 1, 1);
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	return R_tmpnam2(base, dir, ".tmp");
+}
+
+
+// write the index for a freshly-parsed file to a temporary file, then
+// rename it into place, so that readers never see a partial index;
+// failures are reported as warnings, since the index is only an
+// optimization
+void json_index_save(const struct json *obj, SEXP sbuffer)
+{
+	SEXP sindex;
+	const struct corpus_filebuf *buf;
+	const struct corpus_datatype *type;
+	const struct corpus_datatype_record *record;
+	const struct utf8lite_text *name;
+	struct json_index_header header;
+	struct json_index_row row;
+	FILE *stream;
+	const char *file, *path;
+	char *tmp;
+	uint64_t attr;
+	long start, size;
+	R_xlen_t i;
+	int j, k, ok = 0, t;
+
+	sindex = getListElement(sbuffer, "index");
+	if (sindex == R_NilValue) {
+		return;
+	}
+
+	buf = as_filebuf(sbuffer);
+	file = json_index_expand(getListElement(sbuffer, "file"));
+	path = json_index_expand(sindex);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JSON_INDEX_MAGIC, sizeof(header.magic));
+	header.bom = JSON_INDEX_BOM;
+	header.version = JSON_INDEX_VERSION;
+	header.nrow = (uint64_t)obj->nrow;
+	header.type_id = obj->type_id;
+	header.nname = obj->schema->names.ntype;
+	header.ntype = obj->schema->ntype;
+
+	if (json_index_stat(file, &header)) {
+		return;
+	}
+
+	tmp = json_index_tmpnam(path);
+	if (!(stream = fopen(tmp, "wb"))) {
+		R_free_tmpnam(tmp);
+		Rf_warning("failed opening index file '%s' for writing: %s",
+			   path, strerror(errno));
+		return;
+	}
+
+	if (!write_all(stream, &header, sizeof(header))) {
+		goto out;
+	}
+
+	for (k = 0; k < obj->schema->names.ntype; k++) {
+		name = &obj->schema->names.types[k].text;
+		attr = (uint64_t)name->attr;
+		if (!write_all(stream, &attr, sizeof(attr))
+				|| !write_all(stream, name->ptr,
+					      UTF8LITE_TEXT_SIZE(name))) {
+			goto out;
+		}
+	}
+
+	if ((start = ftell(stream)) < 0) {
+		goto out;
+	}
+
+	for (t = 0; t < obj->schema->ntype; t++) {
+		type = &obj->schema->types[t];
+		if (!write_int32(stream, type->kind)) {
+			goto out;
+		}
+
+		switch (type->kind) {
+		case CORPUS_DATATYPE_ARRAY:
+			if (!write_int32(stream, type->meta.array.type_id)
+					|| !write_int32(stream,
+						type->meta.array.length)) {
+				goto out;
+			}
+			break;
+
+		case CORPUS_DATATYPE_RECORD:
+			record = &type->meta.record;
+			if (!write_int32(stream, record->nfield)) {
+				goto out;
+			}
+			for (j = 0; j < record->nfield; j++) {
+				if (!write_int32(stream, record->type_ids[j])
+						|| !write_int32(stream,
+							record->name_ids[j])) {
+					goto out;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if ((size = ftell(stream)) < 0
+			|| !write_pad(stream, (size_t)(size - start))) {
+		goto out;
+	}
+
+	for (i = 0; i < obj->nrow; i++) {
+		row.offset = (uint64_t)(obj->rows[i].ptr - buf->map_addr);
+		row.size = (uint64_t)obj->rows[i].size;
+		row.type_id = obj->rows[i].type_id;
+		if (fwrite(&row, sizeof(row), 1, stream) != 1) {
+			goto out;
+		}
+	}
+
+	ok = 1;
+out:
+	if (fclose(stream) != 0) {
+		ok = 0;
+	}
+#if defined(_WIN32) || defined(_WIN64)
+	// rename does not replace an existing file on Windows
+	if (ok) {
+		remove(path);
+	}
+#endif
+	if (ok && rename(tmp, path) != 0) {
+		ok = 0;
+	}
+	if (!ok) {
+		remove(tmp);
+	}
+	R_free_tmpnam(tmp);
+
+	if (!ok) {
+		Rf_warning("failed writing index file '%s'", path);
+	}
+}
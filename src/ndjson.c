@@ -14,32 +14,224 @@
  * limitations under the License.
  */
 
-#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "rcorpus.h"
+#include <R_ext/Connections.h>
 
+#if R_CONNECTIONS_VERSION != 1
+#error "unsupported R connections API version"
+#endif
 
-SEXP mmap_ndjson(SEXP sfile, SEXP stext)
+// number of bytes to request from the connection at a time
+#define NDJSON_READ_SIZE (4 * 1024 * 1024)
+
+
+SEXP mmap_ndjson(SEXP sfile, SEXP stext, SEXP sthreads, SEXP sindex,
+		 SEXP sfields)
 {
 	SEXP ans, sbuf;
 
-	PROTECT(sbuf = alloc_filebuf(sfile));
-	PROTECT(ans = alloc_json(sbuf, R_NilValue, R_NilValue, stext));
-	as_json(ans); // force data load
+	PROTECT(sbuf = alloc_filebuf(sfile, sindex));
+	if (sfields != R_NilValue) {
+		PROTECT(ans = project_json(sbuf, sfields, stext));
+	} else {
+		PROTECT(ans = alloc_json(sbuf, R_NilValue, R_NilValue, stext));
+		load_json(ans, sthreads); // force data load
+	}
 	UNPROTECT(2);
 
 	return ans;
 }
 
 
-SEXP read_ndjson(SEXP sbuffer, SEXP stext)
+struct reader {
+	uint8_t *base;
+	size_t size, size_max;
+	size_t parsed; // number of bytes parsed into rows
+	R_xlen_t nrow_max;
+};
+
+
+static void reader_destroy(void *obj)
+{
+	struct reader *r = obj;
+	corpus_free(r->base);
+}
+
+
+// update the row pointers after the data moves from 'old' to 'base'
+static void reader_rebase(struct json *obj, const uint8_t *base,
+			  uintptr_t old)
+{
+	R_xlen_t i;
+
+	if ((uintptr_t)base == old) {
+		return;
+	}
+
+	for (i = 0; i < obj->nrow; i++) {
+		obj->rows[i].ptr = base + ((uintptr_t)obj->rows[i].ptr - old);
+	}
+}
+
+
+// make room to read 'nadd' more bytes
+static void reader_grow(struct reader *r, struct json *obj, size_t nadd)
 {
-	SEXP ans;
+	void *base = r->base;
+	uintptr_t old = (uintptr_t)r->base;
+	size_t size_max = r->size_max;
+	int err = 0;
+
+	if (r->size_max - r->size >= nadd) {
+		return;
+	}
+
+	TRY(corpus_bigarray_grow(&base, &size_max, 1, r->size, nadd));
+	r->base = base;
+	r->size_max = size_max;
+	reader_rebase(obj, r->base, old);
+out:
+	CHECK_ERROR(err);
+}
+
+
+// free the excess capacity; if that fails, keep the larger buffer
+static void reader_trim(struct reader *r, struct json *obj)
+{
+	void *base;
+	uintptr_t old = (uintptr_t)r->base;
+
+	if (r->size == 0 || r->size == r->size_max) {
+		return;
+	}
+
+	if ((base = corpus_realloc(r->base, r->size))) {
+		r->base = base;
+		r->size_max = r->size;
+		reader_rebase(obj, r->base, old);
+	}
+}
+
+
+// parse the complete lines read so far; if 'final' is non-zero, parse a
+// trailing line without a newline
+static void reader_parse(struct reader *r, struct json *obj, int final)
+{
+	const uint8_t *ptr, *line_end, *end;
+	size_t size;
+	int err = 0;
+
+	ptr = r->base + r->parsed;
+	end = r->base + r->size;
+
+	while (ptr != end) {
+		RCORPUS_CHECK_INTERRUPT(obj->nrow);
+
+		line_end = memchr(ptr, '\n', (size_t)(end - ptr));
+		if (line_end) {
+			line_end++;
+		} else if (final) {
+			line_end = end;
+		} else {
+			break;
+		}
+
+		if (obj->nrow == r->nrow_max) {
+			size = (size_t)r->nrow_max;
+			TRY(size == R_XLEN_T_MAX ? CORPUS_ERROR_OVERFLOW : 0);
+			TRY(corpus_bigarray_grow((void **)&obj->rows, &size,
+						 sizeof(*obj->rows), size, 1));
+			r->nrow_max = (R_xlen_t)size;
+		}
+
+		TRY(corpus_data_assign(&obj->rows[obj->nrow], obj->schema,
+				       ptr, (size_t)(line_end - ptr)));
+		TRY(corpus_schema_union(obj->schema, obj->type_id,
+					obj->rows[obj->nrow].type_id,
+					&obj->type_id));
+		obj->nrow++;
+		ptr = line_end;
+	}
+
+	r->parsed = (size_t)(ptr - r->base);
+out:
+	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON data",
+			   (uint64_t)(obj->nrow + 1));
+}
+
+
+SEXP read_ndjson_connection(SEXP scon, SEXP stext, SEXP sthreads,
+			    SEXP sfields)
+{
+	SEXP ans, sbuffer, sctx;
+	Rconnection con;
+	struct reader *r;
+	struct json *obj;
+	struct corpus_data *rows;
+	uintptr_t old;
+	size_t nread;
+	int err = 0, nthread, parse;
+
+	con = R_GetConnection(scon);
+	nthread = as_nthread(sthreads, R_XLEN_T_MAX);
+
+	// a projection gets scanned after the read finishes
+	parse = (nthread == 1 && sfields == R_NilValue);
+
+	PROTECT(sctx = alloc_context(sizeof(*r), reader_destroy));
+	r = as_context(sctx);
+
+	// the JSON object gets its buffer after the read finishes
+	PROTECT(ans = alloc_json(R_NilValue, R_NilValue, R_NilValue, stext));
+	obj = R_ExternalPtrAddr(getListElement(ans, "handle"));
+
+	// with one thread, parse the lines as they arrive
+	do {
+		reader_grow(r, obj, NDJSON_READ_SIZE);
+		nread = R_ReadConnection(con, r->base + r->size,
+					 NDJSON_READ_SIZE);
+		r->size += nread;
+
+		if (parse) {
+			reader_parse(r, obj, nread == 0);
+		}
+	} while (nread > 0);
+
+	// move the data to an R raw vector, so that it gets saved with the
+	// object, and free the native buffer; shrink the native buffer
+	// first, so that the copy only doubles the data size
+	reader_trim(r, obj);
+	PROTECT(sbuffer = allocVector(RAWSXP, (R_xlen_t)r->size));
+	if (r->size > 0) {
+		memcpy(RAW(sbuffer), r->base, r->size);
+	}
+	old = (uintptr_t)r->base;
+	free_context(sctx);
+	reader_rebase(obj, RAW(sbuffer), old);
 
-	assert(TYPEOF(sbuffer) == RAWSXP);
+	SET_VECTOR_ELT(ans, 1, sbuffer);
 
-	PROTECT(ans = alloc_json(sbuffer, R_NilValue, R_NilValue, stext));
-	as_json(ans); // force data load
-	UNPROTECT(1);
+	if (sfields != R_NilValue) {
+		ans = project_json(sbuffer, sfields, stext);
+	} else if (parse) {
+		// free excess memory, ensuring the rows are non-NULL, so the
+		// data does not get parsed again
+		TRY_ALLOC(rows = corpus_realloc(obj->rows,
+						(obj->nrow ? obj->nrow : 1)
+						* sizeof(*obj->rows)));
+		obj->rows = rows;
+		obj->kind = (obj->type_id < 0 ? CORPUS_DATATYPE_ANY
+			     : obj->schema->types[obj->type_id].kind);
+	} else {
+		load_json(ans, sthreads);
+	}
 
+out:
+	CHECK_ERROR(err);
+	UNPROTECT(3);
 	return ans;
 }
@@ -128,11 +128,12 @@ struct decode {
 };
 
 struct json {
-	struct corpus_schema schema;
+	struct corpus_schema *schema; // owned, or shared with the parent
 	struct corpus_data *rows;
 	R_xlen_t nrow;
 	int type_id;
 	int kind;
+	int own_schema;
 };
 
 enum stemmer_type {
@@ -144,6 +145,9 @@ enum stemmer_type {
 struct stemmer_rfunc {
 	SEXP fn;
 	SEXP rho;
+	SEXP stems;			// preserved stems from batch calls
+	struct corpus_textset words;	// inputs for the batch stems
+	int has_words;
 };
 
 struct stemmer {
@@ -157,25 +161,69 @@ struct stemmer {
 	int error;
 };
 
-struct rcorpus_text {
+struct token_cache {
+	int *type_id;		// type IDs of the non-ignored tokens
+	int *start;		// byte offset of each token in its text
+	R_xlen_t *offset;	// text i has tokens offset[i], ..., offset[i+1]-1
+	R_xlen_t ntoken;
+	R_xlen_t ntoken_max;
+};
+
+// validated text spans, shared by handles that differ only in their filters
+struct text_spans {
 	struct utf8lite_text *text;
+	R_xlen_t length;
+	int refcount;
+};
+
+struct filter_entry;
+
+struct rcorpus_text {
+	struct text_spans *spans;
+	struct utf8lite_text *text;	// same as spans->text
 	struct corpus_filter filter;
 	struct corpus_sentfilter sentfilter;
 	struct stemmer stemmer;
+	struct filter_entry *cached_filter; // shared filter setup, or NULL
+	struct token_cache tokens;
 	R_xlen_t length;
 	int has_filter;
 	int valid_filter;
 	int has_sentfilter;
 	int valid_sentfilter;
 	int has_stemmer;
+	int has_tokens;
+};
+
+struct filter_clone {
+	struct corpus_filter filter;
+	struct stemmer stemmer;
+	int has_filter;
+	int has_stemmer;
+};
+
+struct locate_item {
+	int text_id;
+	int term_id;
+	struct utf8lite_text instance;
+	int before;	// bytes of context before the instance, or -1 for all
+	int after;	// bytes of context after the instance, or -1 for all
+};
+
+struct locate {
+	struct locate_item *items;
+	int nitem;
+	int nitem_max;
 };
 
 struct termset {
 	struct corpus_termset set;
 	struct utf8lite_text *items;
+	int *source;	// item for each set term
 	int has_set;
 	int max_length;
 	int nitem;
+	int nsource_max;
 };
 
 /* context */
@@ -205,6 +253,8 @@ void stemmer_init_none(struct stemmer *s);
 void stemmer_init_snowball(struct stemmer *s, const char *algorithm);
 void stemmer_init_rfunc(struct stemmer *s, SEXP fn, SEXP rho);
 void stemmer_destroy(struct stemmer *s);
+void stemmer_batch(struct stemmer *s, const struct utf8lite_text *words,
+		   int nword);
 const char *stemmer_snowball_name(const char *alias);
 
 SEXP stem_snowball(SEXP x, SEXP algorithm);
@@ -218,6 +268,12 @@ SEXP logging_on(void);
 SEXP alloc_json(SEXP buffer, SEXP field, SEXP rows, SEXP text);
 int is_json(SEXP data);
 struct json *as_json(SEXP data);
+void load_json(SEXP data, SEXP threads);
+SEXP project_json(SEXP buffer, SEXP fields, SEXP text);
+
+/* json index */
+int json_index_load(struct json *obj, SEXP buffer);
+void json_index_save(const struct json *obj, SEXP buffer);
 
 SEXP as_integer_json(SEXP data);
 SEXP as_double_json(SEXP data);
@@ -239,7 +295,7 @@ SEXP scalar_data(const struct corpus_data *d, const struct corpus_schema *s,
 		 int *overflowptr);
 
 /* file buffer */
-SEXP alloc_filebuf(SEXP file);
+SEXP alloc_filebuf(SEXP file, SEXP index);
 int is_filebuf(SEXP sbuf);
 struct corpus_filebuf *as_filebuf(SEXP sbuf);
 
@@ -253,6 +309,13 @@ struct corpus_sentfilter *text_sentfilter(SEXP x);
 SEXP as_text_character(SEXP text, SEXP filter);
 
 SEXP alloc_text_handle(void);
+SEXP subset_text_handle(SEXP text, SEXP i);
+int text_has_spans(SEXP text);
+struct utf8lite_text *text_spans_alloc(SEXP handle, R_xlen_t n);
+struct utf8lite_text *text_spans_adopt(SEXP handle,
+				       struct utf8lite_text *text,
+				       R_xlen_t n);
+SEXP share_text_handle(SEXP text);
 SEXP coerce_text(SEXP x);
 SEXP length_text(SEXP text);
 SEXP names_text(SEXP text);
@@ -266,16 +329,39 @@ SEXP text_valid(SEXP x);
 
 /* text filter */
 SEXP as_text_filter_connector(SEXP value);
+int text_filter_can_clone(SEXP x);
+void text_filter_clone_init(struct filter_clone *clone, SEXP x);
+void text_filter_clone_destroy(struct filter_clone *clone);
+void filter_entry_release(struct filter_entry *entry);
+const struct token_cache *text_token_cache(SEXP x);
+int text_has_token_cache(SEXP x);
+void token_cache_destroy(struct token_cache *cache);
 
 /* search */
-SEXP alloc_search(SEXP sterms, const char *name, struct corpus_filter *filter);
+SEXP alloc_search(SEXP stermset);
 int is_search(SEXP search);
 struct corpus_search *as_search(SEXP search);
 SEXP items_search(SEXP search);
+const int *source_search(SEXP search);
+
+/* text index */
+struct text_index;
+int is_text_index(SEXP sindex);
+struct text_index *as_text_index(SEXP sindex);
+int text_index_ntext(const struct text_index *index);
+void text_index_mark(const struct text_index *index,
+		     const struct corpus_termset *terms, uint8_t *hit);
+
+/* search results */
+SEXP make_instances(struct locate *loc, SEXP x,
+		    const struct utf8lite_text *text);
 
 /* term set */
 SEXP alloc_termset(SEXP sterms, const char *name,
 		   struct corpus_filter *filter, int allow_dup);
+SEXP alloc_text_termset(SEXP sterms, const char *name, SEXP x,
+			int max_dist, int allow_dup);
+int termset_has_pattern(SEXP sterms);
 int is_termset(SEXP termset);
 struct termset *as_termset(SEXP termset);
 SEXP items_termset(SEXP termset);
@@ -283,28 +369,46 @@ SEXP items_termset(SEXP termset);
 /* text processing */
 SEXP abbreviations(SEXP kind);
 SEXP term_stats(SEXP x, SEXP ngrams, SEXP min_count, SEXP max_count,
-		SEXP min_support, SEXP max_support, SEXP output_types);
-SEXP term_matrix(SEXP x, SEXP ngrams, SEXP select, SEXP group);
-SEXP text_count(SEXP x, SEXP terms);
-SEXP text_detect(SEXP x, SEXP terms);
-SEXP text_locate(SEXP x, SEXP terms);
-SEXP text_match(SEXP x, SEXP terms);
+		SEXP min_support, SEXP max_support, SEXP output_types,
+		SEXP capacity);
+SEXP term_matrix(SEXP x, SEXP ngrams, SEXP select, SEXP group,
+		 SEXP transpose, SEXP threads);
+SEXP text_count(SEXP x, SEXP terms, SEXP max_dist, SEXP threads,
+		SEXP index);
+SEXP text_detect(SEXP x, SEXP terms, SEXP max_dist, SEXP threads,
+		 SEXP index);
+SEXP text_dictionary(SEXP x, SEXP terms, SEXP category, SEXP weight,
+		     SEXP max_dist, SEXP threads, SEXP index);
+SEXP text_index(SEXP x);
+SEXP text_locate(SEXP x, SEXP terms, SEXP max_dist, SEXP window,
+		 SEXP threads, SEXP index);
+SEXP text_match(SEXP x, SEXP terms, SEXP max_dist, SEXP threads,
+		SEXP index);
 SEXP text_nsentence(SEXP x);
 SEXP text_ntoken(SEXP x);
 SEXP text_ntype(SEXP x, SEXP collapse);
+SEXP text_sample(SEXP x, SEXP terms, SEXP size, SEXP max_dist, SEXP window,
+		 SEXP threads, SEXP index);
 SEXP text_split_sentences(SEXP x, SEXP size);
 SEXP text_split_tokens(SEXP x, SEXP size);
+SEXP text_stats(SEXP x);
 SEXP text_sub(SEXP x, SEXP start, SEXP end);
+SEXP text_substring_count(SEXP x, SEXP index, SEXP patterns);
+SEXP text_substring_index(SEXP x);
+SEXP text_substring_locate(SEXP x, SEXP index, SEXP patterns);
 SEXP text_tokens(SEXP x);
 SEXP text_types(SEXP x, SEXP collapse);
 SEXP stopwords(SEXP kind);
 
 /* json values */
-SEXP mmap_ndjson(SEXP file, SEXP text);
-SEXP read_ndjson(SEXP buffer, SEXP text);
+SEXP mmap_ndjson(SEXP file, SEXP text, SEXP threads, SEXP index,
+		 SEXP fields);
+SEXP read_ndjson_connection(SEXP con, SEXP text, SEXP threads,
+			    SEXP fields);
 
 /* internal utility functions */
 double *as_weights(SEXP sweights, R_xlen_t n);
+int as_nthread(SEXP sthreads, R_xlen_t nwork);
 int encodes_utf8(cetype_t ce);
 int findListElement(SEXP list, const char *str);
 SEXP getListElement(SEXP list, const char *str);
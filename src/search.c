@@ -76,9 +76,9 @@ struct corpus_search *as_search(SEXP ssearch)
 }
 
 
-SEXP alloc_search(SEXP sterms, const char *name, struct corpus_filter *filter)
+SEXP alloc_search(SEXP stermset)
 {
-	SEXP ans, sset, items;
+	SEXP ans;
 	const struct corpus_termset_term *term;
 	struct corpus_search *obj;
 	struct termset *termset;
@@ -91,12 +91,10 @@ SEXP alloc_search(SEXP sterms, const char *name, struct corpus_filter *filter)
 	PROTECT(ans = R_MakeExternalPtr(obj, SEARCH_TAG, R_NilValue)); nprot++;
 	R_RegisterCFinalizerEx(ans, free_search, TRUE);
 
-	PROTECT(sset = alloc_termset(sterms, name, filter, 1)); nprot++;
-	termset = as_termset(sset);
-	items = items_termset(sset);
-	R_SetExternalPtrProtected(ans, items);
+	termset = as_termset(stermset);
+	R_SetExternalPtrProtected(ans, stermset);
 
-	n = termset->nitem;
+	n = termset->set.nitem;
 	for (i = 0; i < n; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 		term = &termset->set.items[i];
@@ -113,5 +111,12 @@ out:
 
 SEXP items_search(SEXP ssearch)
 {
-	return R_ExternalPtrProtected(ssearch);
+	return items_termset(R_ExternalPtrProtected(ssearch));
+}
+
+
+// the item for each search term ID
+const int *source_search(SEXP ssearch)
+{
+	return as_termset(R_ExternalPtrProtected(ssearch))->source;
 }
@@ -95,6 +95,190 @@ out:
 }
 
 
+#define STEM_BATCH_SIZE 65536
+
+static int stem_batch_get(const struct stemmer *stemmer, const uint8_t *ptr,
+			  int len, const uint8_t **stemptr, int *lenptr)
+{
+	const struct stemmer_rfunc *rfunc = &stemmer->value.rfunc;
+	struct utf8lite_message msg;
+	struct utf8lite_text text;
+	SEXP outchr;
+	int id;
+
+	if (!rfunc->has_words) {
+		return 0;
+	}
+
+	if (utf8lite_text_assign(&text, ptr, (size_t)len, 0, &msg)) {
+		return 0;
+	}
+
+	if (!corpus_textset_has(&rfunc->words, &text, &id)) {
+		return 0;
+	}
+
+	outchr = STRING_ELT(rfunc->stems, id);
+
+	if (stemptr) {
+		*stemptr = (outchr == NA_STRING ? NULL
+			    : (const uint8_t *)CHAR(outchr));
+	}
+	if (lenptr) {
+		*lenptr = (outchr == NA_STRING ? -1 : LENGTH(outchr));
+	}
+
+	return 1;
+}
+
+
+// get a UTF-8 version of a stem from a batch call, or R_NilValue if invalid
+static SEXP stem_batch_char(SEXP outchr)
+{
+	struct utf8lite_message msg;
+	struct utf8lite_text text;
+
+	if (outchr == NA_STRING) {
+		return outchr;
+	}
+
+	switch (getCharCE(outchr)) {
+	case CE_ANY:
+	case CE_UTF8:
+		break;
+
+	case CE_NATIVE:
+#if defined(_WIN32) || defined(_WIN64)
+		outchr = mkCharCE(translateCharUTF8(outchr), CE_UTF8);
+#endif
+		break;
+
+	default:
+		return R_NilValue;
+	}
+
+	if (utf8lite_text_assign(&text, (const uint8_t *)CHAR(outchr),
+				 (size_t)LENGTH(outchr), 0, &msg)) {
+		return R_NilValue;
+	}
+
+	return outchr;
+}
+
+
+// Call the R stemming function once for each block of words, and remember
+// the results. Blocks where the function fails or returns something other
+// than one stem for each word get skipped; stem_rfunc calls the function
+// for these words individually, and reports errors for them.
+void stemmer_batch(struct stemmer *s, const struct utf8lite_text *words,
+		   int nword)
+{
+	SEXP stems, str, fcall, ans, outchr;
+	struct stemmer_rfunc *rfunc;
+	const struct utf8lite_text **todo;
+	int err = 0, nprot = 0, all_na, begin, end, i, id, k, m, ntodo, nstem,
+	    status;
+
+	if (s->type != STEMMER_RFUNC || nword == 0) {
+		return;
+	}
+
+	rfunc = &s->value.rfunc;
+
+	if (!rfunc->has_words) {
+		TRY(corpus_textset_init(&rfunc->words));
+		rfunc->has_words = 1;
+	}
+
+	// skip the words with known stems
+	todo = (void *)R_alloc(nword, sizeof(*todo));
+	ntodo = 0;
+	for (i = 0; i < nword; i++) {
+		if (!corpus_textset_has(&rfunc->words, &words[i], NULL)) {
+			todo[ntodo++] = &words[i];
+		}
+	}
+
+	if (ntodo == 0) {
+		return;
+	}
+
+	// make room for the new stems
+	nstem = rfunc->words.nitem;
+	PROTECT(stems = allocVector(STRSXP, (R_xlen_t)nstem + ntodo)); nprot++;
+	for (i = 0; i < nstem; i++) {
+		SET_STRING_ELT(stems, i, STRING_ELT(rfunc->stems, i));
+	}
+	if (rfunc->stems != R_NilValue) {
+		R_ReleaseObject(rfunc->stems);
+	}
+	R_PreserveObject(stems);
+	rfunc->stems = stems;
+
+	PROTECT(fcall = lang2(rfunc->fn, R_NilValue)); nprot++;
+
+	for (begin = 0; begin < ntodo; begin = end) {
+		end = (ntodo - begin > STEM_BATCH_SIZE ? begin + STEM_BATCH_SIZE
+						       : ntodo);
+		m = end - begin;
+
+		PROTECT(str = allocVector(STRSXP, m)); nprot++;
+		for (k = 0; k < m; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+			SET_STRING_ELT(str, k, mkCharLenCE(
+				(const char *)todo[begin + k]->ptr,
+				(int)UTF8LITE_TEXT_SIZE(todo[begin + k]),
+				CE_UTF8));
+		}
+		SETCADR(fcall, str);
+
+		PROTECT(ans = R_tryEvalSilent(fcall, rfunc->rho, &status));
+		nprot++;
+
+		if (status || XLENGTH(ans) != m) {
+			goto next;
+		}
+
+		if (TYPEOF(ans) == LGLSXP) {
+			// allow an all-NA logical result
+			for (k = 0; k < m; k++) {
+				if (LOGICAL(ans)[k] != NA_LOGICAL) {
+					goto next;
+				}
+			}
+			all_na = 1;
+		} else if (TYPEOF(ans) == STRSXP) {
+			all_na = 0;
+		} else {
+			goto next;
+		}
+
+		for (k = 0; k < m; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+
+			if (all_na) {
+				outchr = NA_STRING;
+			} else {
+				outchr = stem_batch_char(STRING_ELT(ans, k));
+				if (outchr == R_NilValue) {
+					continue;
+				}
+			}
+
+			TRY(corpus_textset_add(&rfunc->words, todo[begin + k],
+					       &id));
+			SET_STRING_ELT(stems, id, outchr);
+		}
+next:
+		UNPROTECT(2); nprot -= 2;
+	}
+
+out:
+	UNPROTECT(nprot);
+	CHECK_ERROR(err);
+}
+
+
 static int stem_rfunc(const uint8_t *ptr, int len, const uint8_t **stemptr,
 		      int *lenptr, void *context)
 {
@@ -108,6 +292,11 @@ static int stem_rfunc(const uint8_t *ptr, int len, const uint8_t **stemptr,
 
 	assert(!stemmer->error);
 
+	// use the result from a batch call, if one exists
+	if (stem_batch_get(stemmer, ptr, len, stemptr, lenptr)) {
+		return 0;
+	}
+
 	// assume that the R code will error
 	stemmer->error = CORPUS_ERROR_INVAL;
 
@@ -204,6 +393,8 @@ void stemmer_init_rfunc(struct stemmer *s, SEXP fn, SEXP rho)
 {
 	s->value.rfunc.fn = fn;
 	s->value.rfunc.rho = rho;
+	s->value.rfunc.stems = R_NilValue;
+	s->value.rfunc.has_words = 0;
 	s->type = STEMMER_RFUNC;
 	s->stem_func = stem_rfunc;
 	s->stem_context = s;
@@ -217,6 +408,16 @@ void stemmer_destroy(struct stemmer *s)
 	case STEMMER_SNOWBALL:
 		corpus_stem_snowball_destroy(&s->value.snowball);
 		break;
+	case STEMMER_RFUNC:
+		if (s->value.rfunc.has_words) {
+			corpus_textset_destroy(&s->value.rfunc.words);
+			s->value.rfunc.has_words = 0;
+		}
+		if (s->value.rfunc.stems != R_NilValue) {
+			R_ReleaseObject(s->value.rfunc.stems);
+			s->value.rfunc.stems = R_NilValue;
+		}
+		break;
 	default:
 		break;
 	}
@@ -23,19 +23,54 @@
 #include "rcorpus.h"
 
 
+// the term counts for a group
+struct group_counts {
+	int *term_ids;
+	double *weights;
+	int nterm;
+};
+
+
+struct worker {
+	struct filter_clone clone;
+	struct corpus_filter *filter;
+	const struct termset *select;
+	struct corpus_ngram ngram; // n-gram counts for the current group
+	struct corpus_termset terms; // the worker's terms, without select
+	struct corpus_tree prefix; // prefix tree of the selected terms
+	int *prefix_term; // selected term for each prefix, or -1
+	int *active; // prefixes that match the current suffix
+	double *weight; // current group's count for each selected term
+	int *touched; // selected terms with nonzero weight
+	int *buffer;
+	int *type_map;
+	R_xlen_t group_begin, group_end;
+	int ngram_max;
+	int nactive, ntouched;
+	int has_clone, has_ngram, has_prefix, has_terms;
+	int error;
+};
+
+
 struct context {
 	struct utf8lite_render render;
 	struct corpus_termset termset;
-	struct corpus_ngram *ngram;
-	int *buffer;
+	struct corpus_symtab types;
+	struct group_counts *counts;
+	struct worker *worker;
+	const R_xlen_t *group_start, *group_text;
+	int *type_ids;
 	int *ngram_set;
-	int has_render, has_termset;
-	R_xlen_t has_ngram;
+	int ngram_max;
+	int nworker;
+	int has_render, has_termset, has_types;
+	R_xlen_t ngroup;
 };
 
 
 static void context_init(struct context *ctx, SEXP sngrams,
-			 const struct termset *select, R_xlen_t ngroup)
+			 const struct termset *select, R_xlen_t ngroup,
+			 int nworker)
 {
 	const int *ngrams;
 	R_xlen_t i, n;
@@ -61,7 +96,8 @@ static void context_init(struct context *ctx, SEXP sngrams,
 		ngram_max = select ? select->max_length : 1;
 	}
 
-	ctx->buffer = (void *)R_alloc(ngram_max, sizeof(*ctx->buffer));
+	ctx->ngram_max = ngram_max;
+	ctx->type_ids = (void *)R_alloc(ngram_max, sizeof(*ctx->type_ids));
 	ctx->ngram_set = (void *)R_alloc(ngram_max + 1,
 					 sizeof(*ctx->ngram_set));
 	memset(ctx->ngram_set, 0, (ngram_max + 1) * sizeof(*ctx->ngram_set));
@@ -77,14 +113,13 @@ static void context_init(struct context *ctx, SEXP sngrams,
 	}
 
 	if (ngroup > 0) {
-		TRY_ALLOC(ctx->ngram = corpus_malloc(ngroup
-					             * sizeof(*ctx->ngram)));
+		TRY_ALLOC(ctx->counts = corpus_calloc(ngroup,
+						      sizeof(*ctx->counts)));
+		ctx->ngroup = ngroup;
 	}
 
-	while (ctx->has_ngram < ngroup) {
-		TRY(corpus_ngram_init(&ctx->ngram[ctx->has_ngram], ngram_max));
-		ctx->has_ngram++;
-	}
+	TRY_ALLOC(ctx->worker = corpus_calloc(nworker, sizeof(*ctx->worker)));
+	ctx->nworker = nworker;
 
 	if (!select) {
 		TRY(corpus_termset_init(&ctx->termset));
@@ -95,9 +130,21 @@ out:
 }
 
 
+static void context_free_counts(struct context *ctx, R_xlen_t g)
+{
+	corpus_free(ctx->counts[g].weights);
+	corpus_free(ctx->counts[g].term_ids);
+	ctx->counts[g].weights = NULL;
+	ctx->counts[g].term_ids = NULL;
+}
+
+
 static void context_destroy(void *obj)
 {
 	struct context *ctx = obj;
+	struct worker *wk;
+	R_xlen_t g;
+	int w;
 
 	if (ctx->has_render) {
 		utf8lite_render_destroy(&ctx->render);
@@ -107,28 +154,603 @@ static void context_destroy(void *obj)
 		corpus_termset_destroy(&ctx->termset);
 	}
 
-	while (ctx->has_ngram-- > 0) {
-		corpus_ngram_destroy(&ctx->ngram[ctx->has_ngram]);
+	if (ctx->has_types) {
+		corpus_symtab_destroy(&ctx->types);
 	}
 
-	corpus_free(ctx->ngram);
+	for (g = 0; g < ctx->ngroup; g++) {
+		context_free_counts(ctx, g);
+	}
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+
+		if (wk->has_prefix) {
+			corpus_tree_destroy(&wk->prefix);
+		}
+		if (wk->has_terms) {
+			corpus_termset_destroy(&wk->terms);
+		}
+		if (wk->has_ngram) {
+			corpus_ngram_destroy(&wk->ngram);
+		}
+		corpus_free(wk->buffer);
+		corpus_free(wk->touched);
+		corpus_free(wk->weight);
+		corpus_free(wk->active);
+		corpus_free(wk->prefix_term);
+
+		if (wk->has_clone) {
+			text_filter_clone_destroy(&wk->clone);
+		}
+	}
+
+	corpus_free(ctx->counts);
+	corpus_free(ctx->worker);
 }
 
 
-SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
+struct name_rank {
+	const char *ptr;
+	int len;
+	int id;
+};
+
+
+// byte-wise comparison, matching the "C" locale order used by
+// order(..., method = "radix")
+static int name_rank_cmp(const void *x1, const void *x2)
 {
-	SEXP ans = R_NilValue, sctx, snames, si, sj, scount, stext,
-	     scol_names, srow_names, sterm;
+	const struct name_rank *n1 = x1, *n2 = x2;
+	int len = (n1->len < n2->len) ? n1->len : n2->len;
+	int cmp;
+
+	if ((cmp = memcmp(n1->ptr, n2->ptr, len))) {
+		return cmp;
+	} else if (n1->len != n2->len) {
+		return (n1->len < n2->len) ? -1 : +1;
+	} else {
+		return (n1->id < n2->id) ? -1 : (n1->id > n2->id ? +1 : 0);
+	}
+}
+
+
+// sort the names; set rank[i] to the new position of name i
+static SEXP sort_names(SEXP names, int *rank)
+{
+	SEXP ans, name;
+	struct name_rank *order;
+	int i, n = LENGTH(names);
+
+	order = (void *)R_alloc(n, sizeof(*order));
+	for (i = 0; i < n; i++) {
+		name = STRING_ELT(names, i);
+		order[i].ptr = CHAR(name);
+		order[i].len = LENGTH(name);
+		order[i].id = i;
+	}
+
+	qsort(order, n, sizeof(*order), name_rank_cmp);
+
+	PROTECT(ans = allocVector(STRSXP, n));
+	for (i = 0; i < n; i++) {
+		rank[order[i].id] = i;
+		SET_STRING_ELT(ans, i, STRING_ELT(names, order[i].id));
+	}
+	UNPROTECT(1);
+
+	return ans;
+}
+
+
+struct entry {
+	int index;
+	double value;
+};
+
+
+static int entry_cmp(const void *x1, const void *x2)
+{
+	const struct entry *e1 = x1, *e2 = x2;
+	return (e1->index < e2->index) ? -1 : (e1->index > e2->index ? +1 : 0);
+}
+
+
+// sort the entries of a sparse matrix column by increasing index, using
+// 'entry' (with space for at least n items) for scratch
+static void sort_entries(int *index, double *value, int n,
+			 struct entry *entry)
+{
+	int k;
+
+	if (n <= 1) {
+		return;
+	}
+
+	for (k = 0; k < n; k++) {
+		entry[k].index = index[k];
+		entry[k].value = value[k];
+	}
+
+	qsort(entry, n, sizeof(*entry), entry_cmp);
+
+	for (k = 0; k < n; k++) {
+		index[k] = entry[k].index;
+		value[k] = entry[k].value;
+	}
+}
+
+
+static int scan_text(struct corpus_filter *filter,
+		     const struct utf8lite_text *text,
+		     struct corpus_ngram *ngram)
+{
+	int err = 0, type_id;
+
+	TRY(corpus_filter_start(filter, text));
+
+	while (corpus_filter_advance(filter)) {
+		type_id = filter->type_id;
+		if (type_id == CORPUS_TYPE_NONE) {
+			continue;
+		} else if (type_id < 0) {
+			TRY(corpus_ngram_break(ngram));
+			continue;
+		}
+
+		TRY(corpus_ngram_add(ngram, type_id, 1));
+	}
+	TRY(filter->error);
+
+	TRY(corpus_ngram_break(ngram));
+out:
+	return err;
+}
+
+
+static int scan_tokens(const struct token_cache *tokens, R_xlen_t i,
+		       struct corpus_ngram *ngram)
+{
+	R_xlen_t t;
+	int err = 0, type_id;
+
+	for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+		type_id = tokens->type_id[t];
+		if (type_id < 0) {
+			TRY(corpus_ngram_break(ngram));
+			continue;
+		}
+
+		TRY(corpus_ngram_add(ngram, type_id, 1));
+	}
+
+	TRY(corpus_ngram_break(ngram));
+out:
+	return err;
+}
+
+
+static int worker_scan_text(const struct worker *wk,
+			    const struct token_cache *tokens,
+			    const struct utf8lite_text *text, R_xlen_t i,
+			    struct corpus_ngram *ngram)
+{
+	if (tokens) {
+		return scan_tokens(tokens, i, ngram);
+	}
+	return scan_text(wk->filter, &text[i], ngram);
+}
+
+
+// build the prefix tree for the worker's selected terms, skipping the
+// terms with lengths not in the 'ngrams' set
+static void worker_prefix_init(struct worker *wk, const int *ngram_set,
+			       int ngram_max)
+{
+	const struct corpus_termset *set = &wk->select->set;
+	const struct corpus_termset_term *term;
+	int err = 0, i, id, k, nterm = set->nitem;
+
+	TRY(corpus_tree_init(&wk->prefix));
+	wk->has_prefix = 1;
+
+	for (i = 0; i < nterm; i++) {
+		term = &set->items[i];
+		if (term->length > ngram_max || !ngram_set[term->length]) {
+			continue;
+		}
+
+		id = CORPUS_TREE_NONE;
+		for (k = 0; k < term->length; k++) {
+			TRY(corpus_tree_add(&wk->prefix, id,
+					    term->type_ids[k], &id));
+		}
+	}
+
+	TRY_ALLOC(wk->prefix_term = corpus_malloc((wk->prefix.nnode + 1)
+					* sizeof(*wk->prefix_term)));
+	for (id = 0; id < wk->prefix.nnode; id++) {
+		wk->prefix_term[id] = -1;
+	}
+
+	for (i = 0; i < nterm; i++) {
+		term = &set->items[i];
+		if (term->length > ngram_max || !ngram_set[term->length]) {
+			continue;
+		}
+
+		id = CORPUS_TREE_NONE;
+		for (k = 0; k < term->length; k++) {
+			corpus_tree_has(&wk->prefix, id, term->type_ids[k],
+					&id);
+		}
+		wk->prefix_term[id] = i;
+	}
+
+	TRY_ALLOC(wk->active = corpus_malloc(ngram_max
+					     * sizeof(*wk->active)));
+	TRY_ALLOC(wk->weight = corpus_calloc(nterm + 1,
+					     sizeof(*wk->weight)));
+	TRY_ALLOC(wk->touched = corpus_malloc((nterm + 1)
+					      * sizeof(*wk->touched)));
+out:
+	CHECK_ERROR(err);
+}
+
+
+// extend the active prefixes by a token, counting the selected terms
+// that end at the token
+static void worker_select_add(struct worker *wk, int type_id)
+{
+	int id, k, nactive, parent, term;
+
+	nactive = 0;
+
+	// the last pass starts a new prefix at the root
+	for (k = 0; k <= wk->nactive; k++) {
+		parent = (k < wk->nactive) ? wk->active[k] : CORPUS_TREE_NONE;
+		if (!corpus_tree_has(&wk->prefix, parent, type_id, &id)) {
+			continue;
+		}
+
+		if ((term = wk->prefix_term[id]) >= 0) {
+			if (wk->weight[term] == 0) {
+				wk->touched[wk->ntouched++] = term;
+			}
+			wk->weight[term] += 1;
+		}
+
+		if (wk->prefix.nodes[id].nchild > 0) {
+			wk->active[nactive++] = id;
+		}
+	}
+
+	wk->nactive = nactive;
+}
+
+
+// runs without the R API; safe to call from a worker thread
+static int worker_select_text(struct worker *wk,
+			      const struct token_cache *tokens,
+			      const struct utf8lite_text *text, R_xlen_t i)
+{
+	struct corpus_filter *filter = wk->filter;
+	R_xlen_t t;
+	int err = 0, type_id;
+
+	wk->nactive = 0;
+
+	if (tokens) {
+		for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+			type_id = tokens->type_id[t];
+			if (type_id < 0) {
+				wk->nactive = 0;
+				continue;
+			}
+			worker_select_add(wk, type_id);
+		}
+		goto out;
+	}
+
+	TRY(corpus_filter_start(filter, &text[i]));
+
+	while (corpus_filter_advance(filter)) {
+		type_id = filter->type_id;
+		if (type_id == CORPUS_TYPE_NONE) {
+			continue;
+		} else if (type_id < 0) {
+			wk->nactive = 0;
+			continue;
+		}
+		worker_select_add(wk, type_id);
+	}
+	TRY(filter->error);
+out:
+	return err;
+}
+
+
+// move the selected term counts for the current group into 'counts'
+// runs without the R API; safe to call from a worker thread
+static int worker_select_flush(struct worker *wk,
+			       struct group_counts *counts)
+{
+	int err = 0, k, n = wk->ntouched, term;
+
+	if (n == 0) {
+		goto out;
+	}
+
+	TRY_ALLOC(counts->term_ids = corpus_malloc(n
+					* sizeof(*counts->term_ids)));
+	TRY_ALLOC(counts->weights = corpus_malloc(n
+					* sizeof(*counts->weights)));
+
+	for (k = 0; k < n; k++) {
+		term = wk->touched[k];
+		counts->term_ids[k] = term;
+		counts->weights[k] = wk->weight[term];
+		wk->weight[term] = 0;
+	}
+	counts->nterm = n;
+	wk->ntouched = 0;
+out:
+	return err;
+}
+
+
+static void worker_ngram_init(struct worker *wk, int ngram_max)
+{
+	int err = 0;
+
+	TRY(corpus_ngram_init(&wk->ngram, ngram_max));
+	wk->has_ngram = 1;
+	wk->ngram_max = ngram_max;
+
+	TRY(corpus_termset_init(&wk->terms));
+	wk->has_terms = 1;
+
+	TRY_ALLOC(wk->buffer = corpus_malloc(ngram_max
+					     * sizeof(*wk->buffer)));
+out:
+	CHECK_ERROR(err);
+}
+
+
+// move the n-gram counts for the current group into 'counts', and reset
+// the n-gram table, so that only one group is in memory at a time;
+// runs without the R API; safe to call from a worker thread
+static int worker_ngram_flush(struct worker *wk, const int *ngram_set,
+			      struct group_counts *counts)
+{
+	struct corpus_ngram_iter it;
+	int err = 0, n = 0;
+
+	corpus_ngram_iter_make(&it, &wk->ngram, wk->buffer);
+	while (corpus_ngram_iter_advance(&it)) {
+		if (ngram_set[it.length]) {
+			n++;
+		}
+	}
+
+	if (n > 0) {
+		TRY_ALLOC(counts->term_ids = corpus_malloc(n
+					* sizeof(*counts->term_ids)));
+		TRY_ALLOC(counts->weights = corpus_malloc(n
+					* sizeof(*counts->weights)));
+	}
+
+	n = 0;
+	corpus_ngram_iter_make(&it, &wk->ngram, wk->buffer);
+	while (corpus_ngram_iter_advance(&it)) {
+		if (!ngram_set[it.length]) {
+			continue;
+		}
+
+		TRY(corpus_termset_add(&wk->terms, it.type_ids, it.length,
+				       &counts->term_ids[n]));
+		counts->weights[n] = it.weight;
+		n++;
+	}
+	counts->nterm = n;
+
+	corpus_ngram_destroy(&wk->ngram);
+	wk->has_ngram = 0;
+	TRY(corpus_ngram_init(&wk->ngram, wk->ngram_max));
+	wk->has_ngram = 1;
+out:
+	return err;
+}
+
+
+// count the terms in group 'g';
+// runs without the R API; safe to call from a worker thread
+static int worker_scan_group(struct worker *wk, const struct context *ctx,
+			     const struct token_cache *tokens,
+			     const struct utf8lite_text *text, R_xlen_t g)
+{
+	R_xlen_t i, k, begin, end;
+	int err = 0;
+
+	if (ctx->group_start) {
+		begin = ctx->group_start[g];
+		end = ctx->group_start[g + 1];
+	} else {
+		begin = 0;
+		end = 1;
+	}
+
+	for (k = begin; k < end; k++) {
+		i = ctx->group_start ? ctx->group_text[k] : g;
+
+		if (wk->select) {
+			TRY(worker_select_text(wk, tokens, text, i));
+		} else {
+			TRY(worker_scan_text(wk, tokens, text, i,
+					     &wk->ngram));
+		}
+	}
+
+	if (wk->select) {
+		TRY(worker_select_flush(wk, &ctx->counts[g]));
+	} else {
+		TRY(worker_ngram_flush(wk, ctx->ngram_set, &ctx->counts[g]));
+	}
+out:
+	return err;
+}
+
+
+// runs without the R API; safe to call from a worker thread
+static int worker_scan(struct worker *wk, const struct context *ctx,
+		       const struct token_cache *tokens,
+		       const struct utf8lite_text *text)
+{
+	R_xlen_t g;
+	int err = 0;
+
+	for (g = wk->group_begin; g < wk->group_end; g++) {
+		TRY(worker_scan_group(wk, ctx, tokens, text, g));
+	}
+out:
+	return err;
+}
+
+
+// list the texts in each group, so that the groups can be counted one
+// at a time
+static void context_group_texts(struct context *ctx, const int *group,
+				R_xlen_t n, R_xlen_t ngroup)
+{
+	R_xlen_t *start, *next, *texts;
+	R_xlen_t g, i;
+
+	start = (void *)R_alloc(ngroup + 1, sizeof(*start));
+	next = (void *)R_alloc(ngroup + 1, sizeof(*next));
+	texts = (void *)R_alloc(n + 1, sizeof(*texts));
+	memset(start, 0, (ngroup + 1) * sizeof(*start));
+
+	for (i = 0; i < n; i++) {
+		if (group[i] != NA_INTEGER) {
+			start[group[i]]++;
+		}
+	}
+
+	for (g = 0; g < ngroup; g++) {
+		start[g + 1] += start[g];
+	}
+	memcpy(next, start, (ngroup + 1) * sizeof(*next));
+
+	for (i = 0; i < n; i++) {
+		if (group[i] != NA_INTEGER) {
+			texts[next[group[i] - 1]++] = i;
+		}
+	}
+
+	ctx->group_start = start;
+	ctx->group_text = texts;
+}
+
+
+static void context_merge_types(struct context *ctx)
+{
+	const struct corpus_symtab *symtab;
+	struct worker *wk;
+	int err = 0, t, w;
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		symtab = &wk->filter->symtab;
+
+		wk->type_map = (void *)R_alloc(symtab->ntype,
+					       sizeof(*wk->type_map));
+
+		for (t = 0; t < symtab->ntype; t++) {
+			RCORPUS_CHECK_INTERRUPT(t);
+			TRY(corpus_symtab_add_type(&ctx->types,
+						   &symtab->types[t].text,
+						   &wk->type_map[t]));
+		}
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+// add the workers' terms to the global term set, and convert the group
+// counts to use the global term IDs
+static void context_merge_terms(struct context *ctx)
+{
+	const struct corpus_termset_term *term;
+	struct group_counts *counts;
+	struct worker *wk;
+	const int *type_ids;
+	int *term_map;
+	R_xlen_t g;
+	int err = 0, k, t, w;
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		term_map = (void *)R_alloc(wk->terms.nitem, sizeof(*term_map));
+
+		for (t = 0; t < wk->terms.nitem; t++) {
+			RCORPUS_CHECK_INTERRUPT(t);
+
+			term = &wk->terms.items[t];
+			type_ids = term->type_ids;
+
+			if (wk->type_map) {
+				for (k = 0; k < term->length; k++) {
+					ctx->type_ids[k] =
+						wk->type_map[type_ids[k]];
+				}
+				type_ids = ctx->type_ids;
+			}
+
+			TRY(corpus_termset_add(&ctx->termset, type_ids,
+					       term->length, &term_map[t]));
+		}
+
+		for (g = wk->group_begin; g < wk->group_end; g++) {
+			RCORPUS_CHECK_INTERRUPT(g);
+
+			counts = &ctx->counts[g];
+			for (k = 0; k < counts->nterm; k++) {
+				counts->term_ids[k] =
+					term_map[counts->term_ids[k]];
+			}
+		}
+
+		corpus_termset_destroy(&wk->terms);
+		wk->has_terms = 0;
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup,
+		 SEXP stranspose, SEXP sthreads)
+{
+	SEXP ans = R_NilValue, sctx, snames, sp, si, scount, stext,
+	     scol_names, srow_names, sterm, sselect_w;
 	struct context *ctx;
+	struct worker *wk;
+	struct entry *entry;
 	const struct utf8lite_text *text, *type;
 	struct corpus_filter *filter;
+	const struct token_cache *tokens;
 	const struct termset *select;
 	const struct corpus_termset *terms;
+	const struct group_counts *counts;
+	const struct corpus_symtab *types;
 	const int *type_ids;
 	const int *group;
-	struct corpus_ngram_iter it;
-	R_xlen_t i, n, g, ngroup, nz, off;
-	int err = 0, j, m, term_id, type_id, nprot = 0;
+	double *count;
+	int *group_nz, *index, *next, *ptr, *rank, *term_nz;
+	R_xlen_t i, n, g, ncol, ngroup, nz, off;
+	int err = 0, j, k, m, nmax, nterm, term_id, nprot = 0, nthread,
+	    pattern, shared, transpose, w;
 
 	PROTECT(stext = coerce_text(sx)); nprot++;
 	text = as_text(stext, &n);
@@ -139,8 +761,11 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 	}
 
 	select = NULL;
+	pattern = 0;
 	if (sselect != R_NilValue) {
-		PROTECT(sselect = alloc_termset(sselect, "select", filter, 0));
+		pattern = termset_has_pattern(sselect);
+		PROTECT(sselect = alloc_text_termset(sselect, "select", stext,
+						     0, 0));
 		nprot++;
 		select = as_termset(sselect);
 	}
@@ -156,106 +781,142 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 		group = NULL;
 	}
 
+	if (ngroup > INT_MAX) {
+		Rf_error("number of rows (%"PRIu64") exceeds maximum (%d)",
+			 (uint64_t)ngroup, INT_MAX);
+	}
+
+	transpose = LOGICAL(stranspose)[0] == TRUE;
+
+	nthread = as_nthread(sthreads, ngroup);
+
+	// share the main filter's types, which the select patterns resolved
+	// against, when running serially, when the cached token stream
+	// exists, or when the workers cannot clone the filter
+	shared = (nthread == 1 || pattern || text_has_token_cache(stext)
+		  || !text_filter_can_clone(stext));
+
+	// use the cached token stream only if it exists; otherwise scan with
+	// the filter, one worker at a time if the filter is shared
+	if (text_has_token_cache(stext)) {
+		tokens = text_token_cache(stext);
+	} else {
+		tokens = NULL;
+		if (shared) {
+			nthread = 1;
+		}
+	}
+
 	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
         ctx = as_context(sctx);
-	context_init(ctx, sngrams, select, ngroup);
+	context_init(ctx, sngrams, select, ngroup, nthread);
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
+	// split the groups into contiguous blocks, one for each worker
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		wk->group_begin = (R_xlen_t)(((double)ngroup * w)
+					     / ctx->nworker);
+		wk->group_end = (R_xlen_t)(((double)ngroup * (w + 1))
+					   / ctx->nworker);
 
-		if (!group) {
-			g = i;
-		} else if (group[i] == NA_INTEGER) {
-			continue;
+		if (shared) {
+			wk->filter = filter;
+			wk->select = select;
 		} else {
-			assert(0 < group[i] && group[i] <= ngroup);
-			g = (R_xlen_t)(group[i] - 1);
-		}
-
-		TRY(corpus_filter_start(filter, &text[i]));
+			text_filter_clone_init(&wk->clone, stext);
+			wk->has_clone = 1;
+			wk->filter = &wk->clone.filter;
 
-		while (corpus_filter_advance(filter)) {
-			type_id = filter->type_id;
-			if (type_id == CORPUS_TYPE_NONE) {
-				continue;
-			} else if (type_id < 0) {
-				TRY(corpus_ngram_break(&ctx->ngram[g]));
-				continue;
+			if (select) {
+				PROTECT(sselect_w = alloc_termset(
+						items_termset(sselect),
+						"select", wk->filter, 0));
+				nprot++;
+				wk->select = as_termset(sselect_w);
 			}
-
-			TRY(corpus_ngram_add(&ctx->ngram[g], type_id, 1));
 		}
-		TRY(filter->error);
 
-		TRY(corpus_ngram_break(&ctx->ngram[g]));
+		if (select) {
+			worker_prefix_init(wk, ctx->ngram_set,
+					   ctx->ngram_max);
+		} else {
+			worker_ngram_init(wk, ctx->ngram_max);
+		}
 	}
 
-	nz = 0;
+	if (!shared && !select) {
+		TRY(corpus_symtab_init(&ctx->types, 0));
+		ctx->has_types = 1;
+	}
 
-	for (g = 0; g < ngroup; g++) {
-		RCORPUS_CHECK_INTERRUPT(g);
+	// count one group at a time, freeing the n-gram table for each group
+	// after moving its counts to a compact list
+	if (group) {
+		context_group_texts(ctx, group, n, ngroup);
+	}
 
-		corpus_ngram_iter_make(&it, &ctx->ngram[g], ctx->buffer);
-		while (corpus_ngram_iter_advance(&it)) {
-			if (!ctx->ngram_set[it.length]) {
-				continue;
-			}
+	if (ctx->nworker == 1) {
+		wk = &ctx->worker[0];
 
-			if (select) {
-			       if (!corpus_termset_has(&select->set,
-						       it.type_ids,
-						       it.length, NULL)) {
-				       continue;
-			       }
-			} else {
-				TRY(corpus_termset_add(&ctx->termset,
-						       it.type_ids,
-						       it.length, NULL));
-			}
+		for (g = 0; g < ngroup; g++) {
+			RCORPUS_CHECK_INTERRUPT(g);
+			TRY(worker_scan_group(wk, ctx, tokens, text, g));
+		}
+	} else {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthread) schedule(static, 1)
+#endif
+		for (w = 0; w < ctx->nworker; w++) {
+			ctx->worker[w].error = worker_scan(&ctx->worker[w],
+							   ctx, tokens, text);
+		}
 
-			TRY(nz == R_XLEN_T_MAX ? CORPUS_ERROR_OVERFLOW : 0);
-			nz++;
+		for (w = 0; w < ctx->nworker; w++) {
+			TRY(ctx->worker[w].error);
 		}
 	}
 
-	PROTECT(si = allocVector(REALSXP, nz)); nprot++;
-	PROTECT(sj = allocVector(INTSXP, nz)); nprot++;
-	PROTECT(scount = allocVector(REALSXP, nz)); nprot++;
+	if (!select) {
+		if (ctx->has_types) {
+			context_merge_types(ctx);
+		}
+		context_merge_terms(ctx);
+	}
 
-	off = 0;
 	terms = select ? &select->set : &ctx->termset;
+	types = ctx->has_types ? &ctx->types : &filter->symtab;
+	nterm = terms->nitem;
+
+	// count the nonzero entries for each term and each group
+	group_nz = (void *)R_alloc(ngroup, sizeof(*group_nz));
+	term_nz = (void *)R_alloc(nterm, sizeof(*term_nz));
+	memset(term_nz, 0, nterm * sizeof(*term_nz));
+	nz = 0;
+
 	for (g = 0; g < ngroup; g++) {
 		RCORPUS_CHECK_INTERRUPT(g);
 
-		corpus_ngram_iter_make(&it, &ctx->ngram[g], ctx->buffer);
-		while (corpus_ngram_iter_advance(&it)) {
-			if (!ctx->ngram_set[it.length]) {
-				continue;
-			}
+		counts = &ctx->counts[g];
+		TRY(counts->nterm > INT_MAX - nz ? CORPUS_ERROR_OVERFLOW : 0);
 
-			if (!corpus_termset_has(terms, it.type_ids,
-						it.length, &term_id)) {
-				continue;
-			}
-
-			REAL(si)[off] = (double)g;
-			INTEGER(sj)[off] = term_id;
-			REAL(scount)[off] = it.weight;
-			off++;
+		for (k = 0; k < counts->nterm; k++) {
+			term_nz[counts->term_ids[k]]++;
 		}
+		group_nz[g] = counts->nterm;
+		nz += counts->nterm;
 	}
 
-	PROTECT(scol_names = allocVector(STRSXP, terms->nitem));
+	PROTECT(scol_names = allocVector(STRSXP, nterm));
 	nprot++;
 
-	for (i = 0; i < terms->nitem; i++) {
+	for (i = 0; i < nterm; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
 		type_ids = terms->items[i].type_ids;
 		m = terms->items[i].length;
 
 		for (j = 0; j < m; j++) {
-			type = &filter->symtab.types[type_ids[j]].text;
+			type = &types->types[type_ids[j]].text;
 			if (j > 0) {
 				utf8lite_render_char(&ctx->render, ' ');
 			}
@@ -270,17 +931,94 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 		SET_STRING_ELT(scol_names, i, sterm);
 	}
 
+	// put the terms in lexicographic order, unless given a select list
+	rank = (void *)R_alloc(nterm, sizeof(*rank));
+	if (select) {
+		for (i = 0; i < nterm; i++) {
+			rank[i] = (int)i;
+		}
+	} else {
+		PROTECT(scol_names = sort_names(scol_names, rank)); nprot++;
+	}
+
+	// set the column pointers
+	ncol = transpose ? ngroup : nterm;
+	PROTECT(sp = allocVector(INTSXP, ncol + 1)); nprot++;
+	ptr = INTEGER(sp);
+	memset(ptr, 0, (ncol + 1) * sizeof(*ptr));
+
+	if (transpose) {
+		for (g = 0; g < ngroup; g++) {
+			ptr[g + 1] = group_nz[g];
+		}
+	} else {
+		for (i = 0; i < nterm; i++) {
+			ptr[rank[i] + 1] = term_nz[i];
+		}
+	}
+
+	for (i = 0; i < ncol; i++) {
+		ptr[i + 1] += ptr[i];
+	}
+
+	next = (void *)R_alloc(ncol, sizeof(*next));
+	memcpy(next, ptr, ncol * sizeof(*next));
+
+	PROTECT(si = allocVector(INTSXP, nz)); nprot++;
+	PROTECT(scount = allocVector(REALSXP, nz)); nprot++;
+	index = INTEGER(si);
+	count = REAL(scount);
+
+	// fill in the entries, in increasing order of group, freeing the
+	// group counts as we go
+	for (g = 0; g < ngroup; g++) {
+		RCORPUS_CHECK_INTERRUPT(g);
+
+		counts = &ctx->counts[g];
+		for (k = 0; k < counts->nterm; k++) {
+			term_id = counts->term_ids[k];
+			if (transpose) {
+				off = next[g]++;
+				index[off] = rank[term_id];
+			} else {
+				off = next[rank[term_id]]++;
+				index[off] = (int)g;
+			}
+			count[off] = counts->weights[k];
+		}
+
+		context_free_counts(ctx, g);
+	}
+
+	// sort the entries in each column by increasing row, sharing one
+	// scratch array sized for the largest column
+	if (transpose) {
+		nmax = 0;
+		for (g = 0; g < ngroup; g++) {
+			if (group_nz[g] > nmax) {
+				nmax = group_nz[g];
+			}
+		}
+		entry = (void *)R_alloc(nmax + 1, sizeof(*entry));
+
+		for (g = 0; g < ngroup; g++) {
+			RCORPUS_CHECK_INTERRUPT(g);
+			sort_entries(index + ptr[g], count + ptr[g],
+				     ptr[g + 1] - ptr[g], entry);
+		}
+	}
+
 	PROTECT(ans = allocVector(VECSXP, 5)); nprot++;
-	SET_VECTOR_ELT(ans, 0, si);
-	SET_VECTOR_ELT(ans, 1, sj);
+	SET_VECTOR_ELT(ans, 0, sp);
+	SET_VECTOR_ELT(ans, 1, si);
 	SET_VECTOR_ELT(ans, 2, scount);
 	SET_VECTOR_ELT(ans, 3, srow_names);
 	SET_VECTOR_ELT(ans, 4, scol_names);
 
 	PROTECT(snames = allocVector(STRSXP, 5)); nprot++;
-	SET_STRING_ELT(snames, 0, mkChar("i"));
-	SET_STRING_ELT(snames, 1, mkChar("j"));
-	SET_STRING_ELT(snames, 2, mkChar("count"));
+	SET_STRING_ELT(snames, 0, mkChar("p"));
+	SET_STRING_ELT(snames, 1, mkChar("i"));
+	SET_STRING_ELT(snames, 2, mkChar("x"));
 	SET_STRING_ELT(snames, 3, mkChar("row_names"));
 	SET_STRING_ELT(snames, 4, mkChar("col_names"));
 	setAttrib(ans, R_NamesSymbol, snames);
@@ -19,16 +19,29 @@
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "rcorpus.h"
 
 
+struct term_rank {
+	double count;
+	double support;
+	int id;
+};
+
+
 struct context {
 	int ngram_max;
 	int *buffer;
 	int *ngram_set;
 	double *support;
 	double *count;
+	R_xlen_t *last;		// last text containing each term (level-wise)
+	struct term_rank *rank;	// scratch space for pruning, size capacity
+	double floor_count;	// upper bound on counts of discarded terms
+	double floor_support;	// upper bound on supports of discarded terms
+	int capacity;		// maximum number of terms, or 0 for unlimited
 	struct utf8lite_render render;
 	struct corpus_ngram ngram;
 	struct corpus_termset termset;
@@ -38,7 +51,7 @@ struct context {
 };
 
 
-static void context_init(struct context *ctx, SEXP sngrams)
+static void context_init(struct context *ctx, SEXP sngrams, SEXP scapacity)
 {
 	const int *ngrams;
 	int *ngram_set;
@@ -73,6 +86,15 @@ static void context_init(struct context *ctx, SEXP sngrams)
 	ctx->ngram_set = ngram_set;
 	ctx->buffer = (void *)R_alloc(ngram_max, sizeof(*ctx->buffer));
 
+	ctx->capacity = (scapacity == R_NilValue ? 0 : INTEGER(scapacity)[0]);
+	ctx->floor_count = 0;
+	ctx->floor_support = 0;
+
+	if (ctx->capacity) {
+		TRY_ALLOC(ctx->rank = corpus_malloc(ctx->capacity
+						    * sizeof(*ctx->rank)));
+	}
+
 	TRY(utf8lite_render_init(&ctx->render, UTF8LITE_ESCAPE_NONE));
 	ctx->has_render = 1;
 
@@ -90,6 +112,8 @@ static void context_destroy(void *obj)
 {
 	struct context *ctx = obj;
 
+	corpus_free(ctx->rank);
+	corpus_free(ctx->last);
 	corpus_free(ctx->count);
 	corpus_free(ctx->support);
 
@@ -105,68 +129,285 @@ static void context_destroy(void *obj)
 }
 
 
-static void context_update(struct context *ctx, double weight)
+static int term_rank_cmp(const void *x1, const void *x2)
+{
+	const struct term_rank *r1 = x1, *r2 = x2;
+
+	if (r1->count > r2->count) {
+		return -1;
+	} else if (r1->count < r2->count) {
+		return +1;
+	} else {
+		return (r1->id < r2->id) ? -1 : (r1->id > r2->id ? +1 : 0);
+	}
+}
+
+
+// Space-Saving style pruning: keep the most frequent half of the terms,
+// and raise the floors to the largest count and support of the discarded
+// terms. Any term not in the set has true count (support) at most
+// floor_count (floor_support), and new terms start at the floors, so the
+// counts of the remaining terms never underestimate their true values.
+static void context_prune(struct context *ctx)
+{
+	struct corpus_termset termset;
+	const struct corpus_termset_term *term;
+	struct term_rank *rank;
+	int err = 0, has_termset = 0, i, id, n, nkeep;
+
+	n = ctx->termset.nitem;
+	nkeep = ctx->capacity / 2;
+	if (nkeep < 1) {
+		nkeep = 1;
+	}
+
+	if (n <= nkeep) {
+		return;
+	}
+
+	// the set never grows past the capacity, so the scratch space fits
+	assert(n <= ctx->capacity);
+	rank = ctx->rank;
+	for (i = 0; i < n; i++) {
+		rank[i].count = ctx->count[i];
+		rank[i].support = ctx->support[i];
+		rank[i].id = i;
+	}
+	qsort(rank, n, sizeof(*rank), term_rank_cmp);
+
+	for (i = nkeep; i < n; i++) {
+		if (rank[i].count > ctx->floor_count) {
+			ctx->floor_count = rank[i].count;
+		}
+		if (rank[i].support > ctx->floor_support) {
+			ctx->floor_support = rank[i].support;
+		}
+	}
+
+	TRY(corpus_termset_init(&termset));
+	has_termset = 1;
+
+	for (i = 0; i < nkeep; i++) {
+		term = &ctx->termset.items[rank[i].id];
+		TRY(corpus_termset_add(&termset, term->type_ids, term->length,
+				       &id));
+		ctx->count[id] = rank[i].count;
+		ctx->support[id] = rank[i].support;
+	}
+
+	corpus_termset_destroy(&ctx->termset);
+	ctx->termset = termset;
+	has_termset = 0;
+out:
+	if (has_termset) {
+		corpus_termset_destroy(&termset);
+	}
+	CHECK_ERROR(err);
+}
+
+
+// get the ID for a term, adding it to the set if it does not exist
+static int context_add_term(struct context *ctx, const int *type_ids,
+			    int length, int *idptr)
 {
-	struct corpus_ngram_iter it;
 	size_t size;
 	double *count;
 	double *support;
+	R_xlen_t *last;
 	int term_id = -1, nterm, nterm_max;
 	int err = 0;
 
+	if (corpus_termset_has(&ctx->termset, type_ids, length, &term_id)) {
+		goto out;
+	}
+
+	if (ctx->capacity && ctx->termset.nitem >= ctx->capacity) {
+		context_prune(ctx);
+	}
+
+	nterm = ctx->termset.nitem;
+	nterm_max = ctx->termset.nitem_max;
+	TRY(corpus_termset_add(&ctx->termset, type_ids, length, &term_id));
+
+	if (ctx->termset.nitem_max != nterm_max) {
+		nterm_max = ctx->termset.nitem_max;
+
+		size = nterm_max * sizeof(*count);
+		TRY_ALLOC(count = corpus_realloc(ctx->count, size));
+		ctx->count = count;
+
+		size = nterm_max * sizeof(*support);
+		TRY_ALLOC(support = corpus_realloc(ctx->support, size));
+		ctx->support = support;
+
+		size = nterm_max * sizeof(*last);
+		TRY_ALLOC(last = corpus_realloc(ctx->last, size));
+		ctx->last = last;
+	}
+	while (nterm < ctx->termset.nitem) {
+		ctx->count[nterm] = ctx->floor_count;
+		ctx->support[nterm] = ctx->floor_support;
+		ctx->last[nterm] = -1;
+		nterm++;
+	}
+
+out:
+	if (idptr) {
+		*idptr = term_id;
+	}
+	return err;
+}
+
+
+// add the text's n-grams to the buffer; use the token cache if the
+// text has one, otherwise scan with the filter without building it
+static int context_scan_text(struct context *ctx,
+			     const struct token_cache *tokens,
+			     struct corpus_filter *filter,
+			     const struct utf8lite_text *text, R_xlen_t i)
+{
+	R_xlen_t t;
+	int err = 0, type_id;
+
+	if (tokens) {
+		for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+			type_id = tokens->type_id[t];
+
+			if (type_id < 0) {
+				TRY(corpus_ngram_break(&ctx->ngram));
+				continue;
+			}
+
+			TRY(corpus_ngram_add(&ctx->ngram, type_id, 1));
+		}
+	} else if (text[i].ptr) {
+		TRY(corpus_filter_start(filter, &text[i]));
+
+		while (corpus_filter_advance(filter)) {
+			type_id = filter->type_id;
+
+			if (type_id == CORPUS_TYPE_NONE) {
+				continue;
+			} else if (type_id < 0) {
+				TRY(corpus_ngram_break(&ctx->ngram));
+				continue;
+			}
+
+			TRY(corpus_ngram_add(&ctx->ngram, type_id, 1));
+		}
+		TRY(filter->error);
+	}
+
+	TRY(corpus_ngram_break(&ctx->ngram));
+out:
+	return err;
+}
+
+
+static void context_update(struct context *ctx, double weight)
+{
+	struct corpus_ngram_iter it;
+	int term_id, err = 0;
+
 	corpus_ngram_iter_make(&it, &ctx->ngram, ctx->buffer);
 	while (corpus_ngram_iter_advance(&it)) {
 		if (!ctx->ngram_set[it.length]) {
 			continue;
 		}
 
-		if (!corpus_termset_has(&ctx->termset, it.type_ids,
-					it.length, &term_id)) {
+		TRY(context_add_term(ctx, it.type_ids, it.length, &term_id));
+		ctx->count[term_id] += it.weight;
+		ctx->support[term_id] += weight;
+	}
+	corpus_ngram_clear(&ctx->ngram);
+out:
+	CHECK_ERROR(err);
+}
 
-			nterm = ctx->termset.nitem;
-			nterm_max = ctx->termset.nitem_max;
-			TRY(corpus_termset_add(&ctx->termset, it.type_ids,
-					       it.length, &term_id));
 
-			if (ctx->termset.nitem_max != nterm_max) {
-				nterm_max = ctx->termset.nitem_max;
+// Apriori-style level-wise counting. An n-gram cannot occur more often,
+// or in more texts, than the (n-1)-grams at its start and end. So after
+// counting the (n-1)-grams, we only need to count the n-grams where both
+// of these meet the minimum count and support; all other n-grams get
+// filtered from the output anyway. The counts for the n-grams that do
+// get counted are exact, so the result matches the exhaustive path.
+static void context_levelwise(struct context *ctx,
+			      const struct token_cache *tokens, R_xlen_t n,
+			      double min_count, double min_support)
+{
+	const int *type_id = tokens->type_id;
+	int *term, *freq;
+	R_xlen_t i, pos, end;
+	int err = 0, id, length, any_freq;
 
-				size = nterm_max * sizeof(*count);
-				TRY_ALLOC(count
-					= corpus_realloc(ctx->count, size));
-				ctx->count = count;
+	term = (void *)R_alloc(tokens->ntoken + 1, sizeof(*term));
+	freq = (void *)R_alloc(tokens->ntoken + 1, sizeof(*freq));
 
-				size = nterm_max * sizeof(*support);
-				TRY_ALLOC(support
-					= corpus_realloc(ctx->support, size));
-				ctx->support = support;
-			}
-			while (nterm < ctx->termset.nitem) {
-				ctx->count[nterm] = 0;
-				ctx->support[nterm] = 0;
-				nterm++;
+	for (length = 1; length <= ctx->ngram_max; length++) {
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+
+			end = tokens->offset[i + 1];
+
+			for (pos = tokens->offset[i]; pos < end; pos++) {
+				term[pos] = -1;
+
+				if (end - pos < length) {
+					continue;
+				}
+
+				// both the prefix and the suffix must be
+				// frequent; unigrams must not be dropped
+				if (length == 1 ? type_id[pos] < 0
+					    : !(freq[pos] && freq[pos + 1])) {
+					continue;
+				}
+
+				TRY(context_add_term(ctx, &type_id[pos], length,
+						     &id));
+				ctx->count[id] += 1;
+				if (ctx->last[id] != i) {
+					ctx->support[id] += 1;
+					ctx->last[id] = i;
+				}
+				term[pos] = id;
 			}
 		}
-		ctx->count[term_id] += it.weight;
-		ctx->support[term_id] += weight;
+
+		any_freq = 0;
+		for (pos = 0; pos < tokens->ntoken; pos++) {
+			RCORPUS_CHECK_INTERRUPT(pos);
+
+			id = term[pos];
+			freq[pos] = (id >= 0 && ctx->count[id] >= min_count
+				     && ctx->support[id] >= min_support);
+			any_freq |= freq[pos];
+		}
+		freq[tokens->ntoken] = 0;
+
+		if (!any_freq) {
+			break;
+		}
 	}
-	corpus_ngram_clear(&ctx->ngram);
 out:
 	CHECK_ERROR(err);
 }
 
 
 SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
-		SEXP smin_support, SEXP smax_support, SEXP soutput_types)
+		SEXP smin_support, SEXP smax_support, SEXP soutput_types,
+		SEXP scapacity)
 {
-	SEXP ans, sctx, sterm, scount, ssupport, stext,
+	SEXP ans, sctx, sterm, scount, ssupport, stext, sapprox, sapprox_names,
 	     sclass, snames, srow_names, stype = NA_STRING;
 	SEXP *stypes;
 	struct context *ctx;
-	const struct utf8lite_text *text, *type = NULL;
+	const struct utf8lite_text *type = NULL;
 	const struct corpus_termset_term *term;
 	struct mkchar mkchar;
 	struct corpus_filter *filter;
+	const struct token_cache *tokens;
+	const struct utf8lite_text *text;
 	double count, supp, min_count, max_count, min_support, max_support;
 	R_xlen_t i, n, iterm, nterm;
 	int output_types;
@@ -192,29 +433,26 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 
 	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
         ctx = as_context(sctx);
-	context_init(ctx, sngrams);
-
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
-
-		TRY(corpus_filter_start(filter, &text[i]));
+	context_init(ctx, sngrams, scapacity);
 
-		while (corpus_filter_advance(filter)) {
-			type_id = filter->type_id;
+	// in approximate mode, memory should not grow with the corpus, so
+	// only use the token cache if the text already has one
+	if (ctx->capacity && !text_has_token_cache(stext)) {
+		tokens = NULL;
+	} else {
+		tokens = text_token_cache(stext);
+	}
 
-			if (type_id == CORPUS_TYPE_NONE) {
-				continue;
-			} else if (type_id < 0) {
-				TRY(corpus_ngram_break(&ctx->ngram));
-				continue;
-			}
+	if (!ctx->capacity && ctx->ngram_max > 1
+			&& (min_count > 1 || min_support > 1)) {
+		context_levelwise(ctx, tokens, n, min_count, min_support);
+	} else {
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
 
-			TRY(corpus_ngram_add(&ctx->ngram, type_id, 1));
+			TRY(context_scan_text(ctx, tokens, filter, text, i));
+			context_update(ctx, 1);
 		}
-		TRY(filter->error);
-
-		TRY(corpus_ngram_break(&ctx->ngram));
-		context_update(ctx, 1);
 	}
 
 	nterm = 0;
@@ -225,6 +463,10 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 		count = ctx->count[i];
 		supp = ctx->support[i];
 
+		if (!ctx->ngram_set[term->length]) {
+			continue;
+		}
+
 		if (!(min_count <= count && count <= max_count)) {
 			continue;
 		}
@@ -269,6 +511,10 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 		count = ctx->count[i];
 		supp = ctx->support[i];
 
+		if (!ctx->ngram_set[term->length]) {
+			continue;
+		}
+
 		if (!(min_count <= count && count <= max_count)) {
 			continue;
 		}
@@ -359,6 +605,21 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 	SET_STRING_ELT(sclass, 1, mkChar("data.frame"));
 	setAttrib(ans, R_ClassSymbol, sclass);
 
+	if (ctx->capacity) {
+		PROTECT(sapprox = allocVector(VECSXP, 3)); nprot++;
+		SET_VECTOR_ELT(sapprox, 0, ScalarInteger(ctx->capacity));
+		SET_VECTOR_ELT(sapprox, 1, ScalarReal(ctx->floor_count));
+		SET_VECTOR_ELT(sapprox, 2, ScalarReal(ctx->floor_support));
+
+		PROTECT(sapprox_names = allocVector(STRSXP, 3)); nprot++;
+		SET_STRING_ELT(sapprox_names, 0, mkChar("capacity"));
+		SET_STRING_ELT(sapprox_names, 1, mkChar("count_error"));
+		SET_STRING_ELT(sapprox_names, 2, mkChar("support_error"));
+		setAttrib(sapprox, R_NamesSymbol, sapprox_names);
+
+		setAttrib(ans, install("approx"), sapprox);
+	}
+
 out:
 	CHECK_ERROR(err);
         free_context(sctx);
@@ -17,6 +17,8 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "rcorpus.h"
 
 #define TERMSET_TAG install("corpus::termset")
@@ -70,6 +72,9 @@ void termset_free(struct termset *obj)
 	corpus_free(obj->items);
 	obj->items = NULL;
 
+	corpus_free(obj->source);
+	obj->source = NULL;
+
 	corpus_free(obj);
 }
 
@@ -98,8 +103,468 @@ struct termset *as_termset(SEXP stermset)
 }
 
 
+// whether the '*' at position i of the word is escaped with a backslash
+// (an escaped '*' is a literal character, not a wildcard)
+static int is_star_escape(const uint8_t *ptr, size_t size, size_t i)
+{
+	return ptr[i] == '\\' && i + 1 < size && ptr[i + 1] == '*';
+}
+
+
+// a term word is a pattern if it has an unescaped '*' wildcard and
+// something else; a lone "*" is a literal type
+static int word_is_pattern(const uint8_t *ptr, size_t size)
+{
+	size_t i;
+	int has_star = 0, has_other = 0;
+
+	for (i = 0; i < size; i++) {
+		if (is_star_escape(ptr, size, i)) {
+			has_other = 1;
+			i++;
+		} else if (ptr[i] == '*') {
+			has_star = 1;
+		} else {
+			has_other = 1;
+		}
+	}
+
+	return has_star && has_other;
+}
+
+
+// remove the backslashes before escaped '*' characters in a literal word
+static void word_unescape(struct utf8lite_text *word)
+{
+	const uint8_t *ptr = word->ptr;
+	size_t i, n = 0, size = UTF8LITE_TEXT_SIZE(word);
+	uint8_t *buf;
+
+	for (i = 0; i < size; i++) {
+		if (is_star_escape(ptr, size, i)) {
+			break;
+		}
+	}
+	if (i == size) {
+		return;
+	}
+
+	buf = (void *)R_alloc(size, 1);
+	for (i = 0; i < size; i++) {
+		if (is_star_escape(ptr, size, i)) {
+			i++;
+		}
+		buf[n++] = ptr[i];
+	}
+
+	word->ptr = buf;
+	word->attr = UTF8LITE_TEXT_BITS(word) | n;
+}
+
+
+static int text_has_pattern(const struct utf8lite_text *text)
+{
+	const uint8_t *ptr = text->ptr;
+	const uint8_t *end = ptr + UTF8LITE_TEXT_SIZE(text);
+	const uint8_t *word;
+
+	while (ptr != end) {
+		if (*ptr == ' ') {
+			ptr++;
+			continue;
+		}
+
+		word = ptr;
+		while (ptr != end && *ptr != ' ') {
+			ptr++;
+		}
+
+		if (word_is_pattern(word, (size_t)(ptr - word))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int termset_has_pattern(SEXP sterms)
+{
+	const struct utf8lite_text *terms;
+	R_xlen_t i, n;
+
+	if (sterms == R_NilValue) {
+		return 0;
+	}
+
+	PROTECT(sterms = coerce_text(sterms));
+	terms = as_text(sterms, &n);
+
+	for (i = 0; i < n; i++) {
+		if (terms[i].ptr && text_has_pattern(&terms[i])) {
+			UNPROTECT(1);
+			return 1;
+		}
+	}
+
+	UNPROTECT(1);
+	return 0;
+}
+
+
+// '*' matches any run of bytes, including the empty one; "\*" matches
+// a literal '*'
+static int glob_match(const uint8_t *pat, size_t npat,
+		      const uint8_t *str, size_t nstr)
+{
+	size_t p = 0, s = 0, star = npat, star_s = 0;
+	int esc;
+
+	while (s < nstr) {
+		esc = (p < npat && is_star_escape(pat, npat, p));
+		if (p < npat && pat[p] == '*') {
+			star = p++;
+			star_s = s;
+		} else if (p < npat && pat[p + esc] == str[s]) {
+			p += 1 + esc;
+			s++;
+		} else if (star != npat) {
+			p = star + 1;
+			s = ++star_s;
+		} else {
+			return 0;
+		}
+	}
+
+	while (p < npat && pat[p] == '*') {
+		p++;
+	}
+
+	return p == npat;
+}
+
+
+static int match_push(int **pmatch, int *nmatch, int *nmatch_max, int id)
+{
+	int *match;
+	int err = 0, size = *nmatch_max;
+
+	if (*nmatch == size) {
+		TRY(corpus_array_size_add(&size, sizeof(*match), *nmatch, 1));
+		TRY_ALLOC(match = corpus_realloc(*pmatch,
+						 size * sizeof(*match)));
+		*pmatch = match;
+		*nmatch_max = size;
+	}
+
+	(*pmatch)[(*nmatch)++] = id;
+out:
+	return err;
+}
+
+
+struct type_order {
+	const struct utf8lite_text *text;
+	int id;
+};
+
+
+// byte-wise comparison, so that the matches do not depend on the order
+// that the filter first saw the types
+static int type_order_cmp(const void *x1, const void *x2)
+{
+	const struct type_order *t1 = x1, *t2 = x2;
+	size_t n1 = UTF8LITE_TEXT_SIZE(t1->text);
+	size_t n2 = UTF8LITE_TEXT_SIZE(t2->text);
+	int cmp;
+
+	if ((cmp = memcmp(t1->text->ptr, t2->text->ptr,
+			  (n1 < n2) ? n1 : n2))) {
+		return cmp;
+	} else if (n1 != n2) {
+		return (n1 < n2) ? -1 : +1;
+	} else {
+		return (t1->id < t2->id) ? -1 : (t1->id > t2->id ? +1 : 0);
+	}
+}
+
+
+static int sort_types(const struct corpus_filter *filter, int *ids, int n)
+{
+	struct type_order *order;
+	int err = 0, i;
+
+	if (n < 2) {
+		return 0;
+	}
+
+	TRY_ALLOC(order = corpus_malloc(n * sizeof(*order)));
+	for (i = 0; i < n; i++) {
+		order[i].text = &filter->symtab.types[ids[i]].text;
+		order[i].id = ids[i];
+	}
+
+	qsort(order, n, sizeof(*order), type_order_cmp);
+
+	for (i = 0; i < n; i++) {
+		ids[i] = order[i].id;
+	}
+	corpus_free(order);
+out:
+	return err;
+}
+
+
+// append the vocabulary types that match the pattern, in byte order,
+// then a -1
+static int pattern_types(struct corpus_filter *filter,
+			 const uint8_t *vocab, int nvocab,
+			 const struct utf8lite_text *pattern,
+			 int **pmatch, int *nmatch, int *nmatch_max)
+{
+	struct utf8lite_textmap *map = &filter->symtab.typemap;
+	const struct utf8lite_text *type;
+	int begin = *nmatch, err = 0, t;
+
+	// normalize the pattern the same way as the types
+	TRY(utf8lite_textmap_set(map, pattern));
+
+	for (t = 0; t < nvocab; t++) {
+		if (!vocab[t] || filter->props[t].drop) {
+			continue;
+		}
+
+		type = &filter->symtab.types[t].text;
+		if (glob_match(map->text.ptr, UTF8LITE_TEXT_SIZE(&map->text),
+			       type->ptr, UTF8LITE_TEXT_SIZE(type))) {
+			TRY(match_push(pmatch, nmatch, nmatch_max, t));
+		}
+	}
+
+	TRY(sort_types(filter, *pmatch + begin, *nmatch - begin));
+	TRY(match_push(pmatch, nmatch, nmatch_max, -1));
+out:
+	return err;
+}
+
+
+static int decode_codes(const struct utf8lite_text *text, int32_t *code)
+{
+	const uint8_t *ptr = text->ptr;
+	const uint8_t *end = ptr + UTF8LITE_TEXT_SIZE(text);
+	int n = 0;
+
+	while (ptr != end) {
+		utf8lite_decode_utf8(&ptr, &code[n]);
+		n++;
+	}
+
+	return n;
+}
+
+
+// Levenshtein distance between code point sequences, using a single
+// row of na + 1 entries; gives up once every entry exceeds max_dist
+static int edit_distance_within(const int32_t *a, int na,
+				const int32_t *b, int nb, int max_dist,
+				int *row)
+{
+	int diag, i, j, rowmin, up, val;
+
+	for (i = 0; i <= na; i++) {
+		row[i] = i;
+	}
+
+	for (j = 1; j <= nb; j++) {
+		diag = row[0];
+		row[0] = j;
+		rowmin = j;
+
+		for (i = 1; i <= na; i++) {
+			up = row[i];
+			val = diag + (a[i - 1] != b[j - 1]);
+			if (row[i - 1] + 1 < val) {
+				val = row[i - 1] + 1;
+			}
+			if (up + 1 < val) {
+				val = up + 1;
+			}
+			diag = up;
+			row[i] = val;
+			if (val < rowmin) {
+				rowmin = val;
+			}
+		}
+
+		if (rowmin > max_dist) {
+			return 0;
+		}
+	}
+
+	return row[na] <= max_dist;
+}
+
+
+// append the vocabulary types within max_dist edits of the query type,
+// in byte order, then a -1
+static int fuzzy_types(struct corpus_filter *filter,
+		       const uint8_t *vocab, int nvocab, int query_id,
+		       int max_dist, int **pmatch, int *nmatch,
+		       int *nmatch_max)
+{
+	const struct utf8lite_text *query, *type;
+	int32_t *qcode, *tcode, *tcode2;
+	int *row;
+	size_t size, tsize_max;
+	int begin = *nmatch, err = 0, nq, nt, t;
+
+	qcode = NULL;
+	tcode = NULL;
+	row = NULL;
+	tsize_max = 0;
+
+	query = &filter->symtab.types[query_id].text;
+	size = UTF8LITE_TEXT_SIZE(query);
+	TRY_ALLOC(qcode = corpus_malloc((size + 1) * sizeof(*qcode)));
+	TRY_ALLOC(row = corpus_malloc((size + 1) * sizeof(*row)));
+	nq = decode_codes(query, qcode);
+
+	for (t = 0; t < nvocab; t++) {
+		if (!vocab[t] || filter->props[t].drop) {
+			continue;
+		}
+
+		type = &filter->symtab.types[t].text;
+		size = UTF8LITE_TEXT_SIZE(type);
+
+		// a type needs at least one edit per code point of length
+		// difference, and has at most one code point per byte
+		if (size + max_dist < (size_t)nq) {
+			continue;
+		}
+
+		if (size + 1 > tsize_max) {
+			TRY_ALLOC(tcode2 = corpus_realloc(tcode, (size + 1)
+							  * sizeof(*tcode)));
+			tcode = tcode2;
+			tsize_max = size + 1;
+		}
+
+		nt = decode_codes(type, tcode);
+		if (nt > nq + max_dist || nq > nt + max_dist) {
+			continue;
+		}
+
+		if (edit_distance_within(qcode, nq, tcode, nt, max_dist,
+					 row)) {
+			TRY(match_push(pmatch, nmatch, nmatch_max, t));
+		}
+	}
+
+	TRY(sort_types(filter, *pmatch + begin, *nmatch - begin));
+	TRY(match_push(pmatch, nmatch, nmatch_max, -1));
+out:
+	corpus_free(row);
+	corpus_free(tcode);
+	corpus_free(qcode);
+	return err;
+}
+
+
+static int termset_add_item(struct termset *obj,
+			    const struct utf8lite_text *term)
+{
+	int err = 0;
+
+	TRY(utf8lite_text_init_copy(&obj->items[obj->nitem], term));
+	obj->nitem++;
+out:
+	return err;
+}
+
+
+static int termset_add_source(struct termset *obj, int id)
+{
+	int *source;
+	int err = 0, size = obj->nsource_max;
+
+	if (id == size) {
+		TRY(corpus_array_size_add(&size, sizeof(*source), id, 1));
+		TRY_ALLOC(source = corpus_realloc(obj->source,
+						  size * sizeof(*source)));
+		obj->source = source;
+		obj->nsource_max = size;
+	}
+
+	obj->source[id] = obj->nitem;
+out:
+	return err;
+}
+
+
+// add every combination of the pattern words' types; word j is a pattern
+// when buf[j] < 0, with its types starting at match[-1 - buf[j]]; a
+// combination that is already in the set keeps its first source
+static int termset_expand(struct termset *obj, const int *buf, int length,
+			  const int *match)
+{
+	int *ids, *pos;
+	int err = 0, id, j, nset;
+
+	ids = NULL;
+	pos = NULL;
+	TRY_ALLOC(ids = corpus_malloc(length * sizeof(*ids)));
+	TRY_ALLOC(pos = corpus_malloc(length * sizeof(*pos)));
+
+	for (j = 0; j < length; j++) {
+		if (buf[j] >= 0) {
+			continue;
+		}
+		pos[j] = -1 - buf[j];
+		if (match[pos[j]] < 0) { // no matching types
+			goto out;
+		}
+	}
+
+	while (1) {
+		for (j = 0; j < length; j++) {
+			ids[j] = (buf[j] >= 0) ? buf[j] : match[pos[j]];
+		}
+
+		nset = obj->set.nitem;
+		TRY(corpus_termset_add(&obj->set, ids, length, &id));
+		if (id == nset) {
+			TRY(termset_add_source(obj, id));
+		}
+
+		// advance to the next combination
+		for (j = length - 1; j >= 0; j--) {
+			if (buf[j] >= 0) {
+				continue;
+			}
+			pos[j]++;
+			if (match[pos[j]] >= 0) {
+				break;
+			}
+			pos[j] = -1 - buf[j];
+		}
+
+		if (j < 0) {
+			break;
+		}
+	}
+
+out:
+	corpus_free(pos);
+	corpus_free(ids);
+	return err;
+}
+
+
 #define CLEANUP() \
 	do { \
+		corpus_free(match); \
+		match = NULL; \
 		corpus_free(buf); \
 		buf = NULL; \
 		if (has_render) { \
@@ -109,8 +574,12 @@ struct termset *as_termset(SEXP stermset)
 	} while (0)
 
 
-SEXP alloc_termset(SEXP sterms, const char *name,
-		   struct corpus_filter *filter, int allow_dup)
+// build a term set; with a vocabulary, resolve the pattern words (and,
+// if max_dist > 0, the other words) to the vocabulary types that they
+// match, each distinct type checked once
+static SEXP termset_make(SEXP sterms, const char *name,
+			 struct corpus_filter *filter, const uint8_t *vocab,
+			 int nvocab, int max_dist, int allow_dup)
 {
 	SEXP ans;
 	struct corpus_wordscan scan;
@@ -120,14 +589,16 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 	struct termset *obj;
 	const uint8_t *ptr;
 	size_t attr, size;
-	int *buf, *buf2;
+	int *buf, *buf2, *match;
 	char *errstr;
 	R_xlen_t i, n;
-	int err,  has_render, id, j, length, max_length,
-	    nbuf, nprot, rendered_error, type_id;
+	int err,  has_render, id, j, length, max_length, nbuf, nmatch,
+	    nmatch_max, npattern, nprot, nset, rendered_error, type_id;
 
 	has_render = 0;
 	buf = NULL;
+	match = NULL;
+	nmatch_max = 0;
 	nprot = 0;
 	err = 0;
 	max_length = 1;
@@ -160,6 +631,8 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 		corpus_wordscan_make(&scan, &terms[i]);
 
 		length = 0;
+		nmatch = 0;
+		npattern = 0;
 		while (corpus_wordscan_advance(&scan)) {
 			// skip over leading spaces
 			if (scan.type == CORPUS_WORD_NONE) {
@@ -184,7 +657,17 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 			type.ptr = (uint8_t *)ptr;
 			type.attr = attr | size;
 
-			TRY(corpus_filter_add_type(filter, &type, &type_id));
+			if (vocab && word_is_pattern(ptr, size)) {
+				type_id = -1 - nmatch;
+				TRY(pattern_types(filter, vocab, nvocab, &type,
+						  &match, &nmatch,
+						  &nmatch_max));
+				npattern++;
+			} else {
+				word_unescape(&type);
+				TRY(corpus_filter_add_type(filter, &type,
+							   &type_id));
+			}
 
 			// expand the buffer if necessary
 			if (length == nbuf) {
@@ -221,7 +704,7 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 
 		for (j = 0; j < length; j++) {
 			type_id = buf[j];
-			if (!filter->props[type_id].drop) {
+			if (type_id < 0 || !filter->props[type_id].drop) {
 				continue;
 			}
 
@@ -239,8 +722,38 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 			goto out;
 		}
 
-		if (!allow_dup
-			&& corpus_termset_has(&obj->set, buf, length, &id)) {
+		// replace each type with the types within max_dist edits
+		for (j = 0; vocab && max_dist > 0 && j < length; j++) {
+			if (buf[j] < 0) {
+				continue;
+			}
+			type_id = buf[j];
+			buf[j] = -1 - nmatch;
+			TRY(fuzzy_types(filter, vocab, nvocab, type_id,
+					max_dist, &match, &nmatch,
+					&nmatch_max));
+			npattern++;
+		}
+
+		if (npattern > 0) {
+			TRY(termset_expand(obj, buf, length, match));
+			TRY(termset_add_item(obj, &terms[i]));
+			continue;
+		}
+
+		if (corpus_termset_has(&obj->set, buf, length, &id)) {
+			// the first pattern that matches a term keeps it
+			if (vocab && text_has_pattern(
+					&obj->items[obj->source[id]])) {
+				TRY(termset_add_item(obj, &terms[i]));
+				continue;
+			}
+
+			if (allow_dup) {
+				continue;
+			}
+
+			id = obj->source[id];
 			utf8lite_render_printf(&render,
 				"%s terms in positions %"PRIu64
 				" and %"PRIu64" (\"", name,
@@ -254,12 +767,12 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 			goto out;
 		}
 
+		nset = obj->set.nitem;
 		TRY(corpus_termset_add(&obj->set, buf, length, &id));
-		if (id == obj->nitem) {
-			TRY(utf8lite_text_init_copy(&obj->items[id],
-						    &terms[i]));
-			obj->nitem = id + 1;
+		if (id == nset) {
+			TRY(termset_add_source(obj, id));
 		}
+		TRY(termset_add_item(obj, &terms[i]));
 	}
 
 	err = 0;
@@ -286,6 +799,130 @@ out:
 }
 
 
+SEXP alloc_termset(SEXP sterms, const char *name,
+		   struct corpus_filter *filter, int allow_dup)
+{
+	return termset_make(sterms, name, filter, NULL, 0, 0, allow_dup);
+}
+
+
+// the types that appear in a text, growing as the filter adds new ones
+struct vocab {
+	uint8_t *seen;
+	int nseen_max;
+};
+
+
+static void vocab_destroy(void *obj)
+{
+	struct vocab *v = obj;
+
+	corpus_free(v->seen);
+	v->seen = NULL;
+}
+
+
+static int vocab_add(struct vocab *v, int type_id)
+{
+	uint8_t *seen;
+	int err = 0, size = v->nseen_max;
+
+	if (type_id >= size) {
+		TRY(corpus_array_size_add(&size, sizeof(*seen), v->nseen_max,
+					  type_id + 1 - v->nseen_max));
+		TRY_ALLOC(seen = corpus_realloc(v->seen, size));
+		memset(seen + v->nseen_max, 0, size - v->nseen_max);
+		v->seen = seen;
+		v->nseen_max = size;
+	}
+
+	v->seen[type_id] = 1;
+out:
+	return err;
+}
+
+
+// mark the types that appear in the text; use the token cache if the
+// text has one, otherwise make one pass with the filter, without
+// keeping the token stream
+static uint8_t *text_vocab(SEXP sx, struct corpus_filter *filter,
+			   int *nvocabptr)
+{
+	SEXP sctx;
+	const struct utf8lite_text *text;
+	const struct token_cache *tokens;
+	struct vocab *v;
+	uint8_t *vocab;
+	R_xlen_t i, k, n;
+	int err = 0, nvocab, type_id;
+
+	PROTECT(sctx = alloc_context(sizeof(*v), vocab_destroy));
+	v = as_context(sctx);
+	text = as_text(sx, &n);
+
+	if (text_has_token_cache(sx)) {
+		tokens = text_token_cache(sx);
+		for (k = 0; k < tokens->ntoken; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+			if ((type_id = tokens->type_id[k]) >= 0) {
+				TRY(vocab_add(v, type_id));
+			}
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (!text[i].ptr) {
+				continue;
+			}
+
+			TRY(corpus_filter_start(filter, &text[i]));
+			while (corpus_filter_advance(filter)) {
+				if ((type_id = filter->type_id) >= 0) {
+					TRY(vocab_add(v, type_id));
+				}
+			}
+			TRY(filter->error);
+		}
+	}
+
+	nvocab = filter->symtab.ntype;
+	vocab = (void *)R_alloc(nvocab + 1, sizeof(*vocab));
+	memset(vocab, 0, (nvocab + 1) * sizeof(*vocab));
+	if (v->seen) {
+		memcpy(vocab, v->seen, ((v->nseen_max < nvocab)
+					? v->nseen_max : nvocab)
+		       * sizeof(*vocab));
+	}
+out:
+	free_context(sctx);
+	CHECK_ERROR(err);
+	UNPROTECT(1);
+	*nvocabptr = nvocab;
+	return vocab;
+}
+
+
+// resolve the term patterns and the fuzzy terms against the types that
+// appear in the text
+SEXP alloc_text_termset(SEXP sterms, const char *name, SEXP sx,
+			int max_dist, int allow_dup)
+{
+	struct corpus_filter *filter;
+	uint8_t *vocab;
+	int nvocab;
+
+	filter = text_filter(sx);
+	if (max_dist == 0 && !termset_has_pattern(sterms)) {
+		return termset_make(sterms, name, filter, NULL, 0, 0,
+				    allow_dup);
+	}
+
+	vocab = text_vocab(sx, filter, &nvocab);
+	return termset_make(sterms, name, filter, vocab, nvocab, max_dist,
+			    allow_dup);
+}
+
+
 static void set_items_termset(SEXP stermset)
 {
 	SEXP items, str;
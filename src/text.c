@@ -65,6 +65,15 @@ static void source_assign(struct source *source, SEXP value)
 }
 
 
+static void text_spans_release(struct text_spans *spans)
+{
+	if (spans && --spans->refcount == 0) {
+		corpus_free(spans->text);
+		corpus_free(spans);
+	}
+}
+
+
 static void free_text(SEXP stext)
 {
         struct rcorpus_text *obj = R_ExternalPtrAddr(stext);
@@ -83,7 +92,9 @@ static void free_text(SEXP stext)
 			stemmer_destroy(&obj->stemmer);
 		}
 
-		corpus_free(obj->text);
+		filter_entry_release(obj->cached_filter);
+		token_cache_destroy(&obj->tokens);
+		text_spans_release(obj->spans);
 		corpus_free(obj);
 	}
 }
@@ -103,6 +114,132 @@ SEXP alloc_text_handle(void)
 }
 
 
+int text_has_spans(SEXP x)
+{
+	SEXP handle;
+
+	if (!is_text(x)) {
+		return 0;
+	}
+
+	handle = getListElement(x, "handle");
+	return R_ExternalPtrAddr(handle) != NULL;
+}
+
+
+struct utf8lite_text *text_spans_adopt(SEXP handle,
+				       struct utf8lite_text *text,
+				       R_xlen_t n)
+{
+	struct rcorpus_text *obj = NULL;
+	struct text_spans *spans = NULL;
+	int err = 0;
+
+	TRY(R_ExternalPtrAddr(handle) ? CORPUS_ERROR_INTERNAL : 0);
+	TRY_ALLOC(spans = corpus_calloc(1, sizeof(*spans)));
+	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+
+	spans->text = text;
+	spans->length = n;
+	spans->refcount = 1;
+
+	obj->spans = spans;
+	obj->text = text;
+	obj->length = n;
+	R_SetExternalPtrAddr(handle, obj);
+
+out:
+	if (err) {
+		corpus_free(obj);
+		corpus_free(spans);
+		corpus_free(text);
+	}
+	CHECK_ERROR(err);
+	return text;
+}
+
+
+struct utf8lite_text *text_spans_alloc(SEXP handle, R_xlen_t n)
+{
+	struct utf8lite_text *text = NULL;
+	int err = 0;
+
+	if (n > 0) {
+		TRY_ALLOC(text = corpus_calloc(n, sizeof(*text)));
+	}
+out:
+	CHECK_ERROR(err);
+	return text_spans_adopt(handle, text, n);
+}
+
+
+SEXP share_text_handle(SEXP x)
+{
+	SEXP ans;
+	struct rcorpus_text *src, *obj;
+	int err = 0;
+
+	PROTECT(ans = alloc_text_handle());
+
+	if (!text_has_spans(x)) {
+		goto out; // the text gets loaded when needed
+	}
+
+	// share the spans, but not the filter state
+	src = R_ExternalPtrAddr(getListElement(x, "handle"));
+	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+	obj->spans = src->spans;
+	obj->spans->refcount++;
+	obj->text = src->text;
+	obj->length = src->length;
+	R_SetExternalPtrAddr(ans, obj);
+
+out:
+	UNPROTECT(1);
+	CHECK_ERROR(err);
+	return ans;
+}
+
+
+SEXP subset_text_handle(SEXP x, SEXP si)
+{
+	SEXP ans;
+	const struct utf8lite_text *text;
+	struct utf8lite_text *text2;
+	const double *index;
+	R_xlen_t i, n, len;
+
+	PROTECT(ans = alloc_text_handle());
+
+	if (!text_has_spans(x)) {
+		goto out; // the subset gets loaded when needed
+	}
+
+	text = as_text(x, &len);
+	index = REAL(si);
+	n = XLENGTH(si);
+
+	// leave invalid indices for load_text to report
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		if (!(1 <= index[i] && index[i] <= (double)len)) {
+			goto out;
+		}
+	}
+
+	// the parent's spans are already validated
+	text2 = text_spans_alloc(ans, n);
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		text2[i] = text[(R_xlen_t)index[i] - 1];
+	}
+
+out:
+	UNPROTECT(1);
+	return ans;
+}
+
+
 SEXP alloc_text(SEXP sources, SEXP source, SEXP row, SEXP start, SEXP stop,
 		SEXP eltnames, SEXP filter)
 {
@@ -271,13 +408,8 @@ SEXP as_text_json(SEXP sdata, SEXP filter)
 
 	handle = getListElement(ans, "handle");
 
-	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
-	R_SetExternalPtrAddr(handle, obj);
-
-	if (nrow > 0) {
-		TRY_ALLOC(obj->text = corpus_calloc(nrow, sizeof(*obj->text)));
-		obj->length = nrow;
-	}
+	text_spans_alloc(handle, nrow);
+	obj = R_ExternalPtrAddr(handle);
 
 	for (i = 0; i < nrow; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
@@ -300,7 +432,6 @@ SEXP as_text_json(SEXP sdata, SEXP filter)
 		}
 	}
 
-out:
 	UNPROTECT(nprot);
 	CHECK_ERROR(err);
 	return ans;
@@ -351,13 +482,8 @@ SEXP as_text_character(SEXP x, SEXP filter)
 
 	handle = getListElement(ans, "handle");
 
-	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
-	R_SetExternalPtrAddr(handle, obj);
-
-	if (nrow > 0) {
-		TRY_ALLOC(obj->text = corpus_calloc(nrow, sizeof(*obj->text)));
-		obj->length = nrow;
-	}
+	text_spans_alloc(handle, nrow);
+	obj = R_ExternalPtrAddr(handle);
 
 	for (i = 0; i < nrow; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
@@ -476,13 +602,8 @@ static void load_text(SEXP x)
 	stop = INTEGER(sstop);
 
 	R_RegisterCFinalizerEx(shandle, free_text, TRUE);
-	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
-	R_SetExternalPtrAddr(shandle, obj);
-
-	if (nrow > 0) {
-		TRY_ALLOC(obj->text = corpus_calloc(nrow, sizeof(*obj->text)));
-		obj->length = nrow;
-	}
+	text_spans_alloc(shandle, nrow);
+	obj = R_ExternalPtrAddr(shandle);
 
 	for (i = 0; i < nrow; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
@@ -559,7 +680,6 @@ static void load_text(SEXP x)
 			      " of a multi-byte character", i + 1);
 		}
 	}
-out:
 	CHECK_ERROR(err);
 }
 
@@ -108,6 +108,8 @@ SEXP text_c(SEXP args, SEXP names, SEXP filter)
 	SEXP ans, elt, elt_sources, elt_table, elt_source, elt_row,
 	     elt_start, elt_stop, ssources, ssource, srow, sstart, sstop;
 	struct context ctx;
+	const struct utf8lite_text *elt_text;
+	struct utf8lite_text *text;
 	double *row;
 	const int *src;
 	int *source, *start, *stop;
@@ -178,6 +180,26 @@ SEXP text_c(SEXP args, SEXP names, SEXP filter)
 	PROTECT(ans = alloc_text(ssources, ssource, srow, sstart, sstop,
 				 names, filter)); nprot++;
 
+	// if all of the arguments are loaded, concatenate their spans
+	for (iarg = 0; iarg < narg; iarg++) {
+		if (!text_has_spans(VECTOR_ELT(args, iarg))) {
+			break;
+		}
+	}
+	if (iarg == narg) {
+		text = text_spans_alloc(getListElement(ans, "handle"), len);
+		off = 0;
+		for (iarg = 0; iarg < narg; iarg++) {
+			RCORPUS_CHECK_INTERRUPT(iarg);
+			elt_text = as_text(VECTOR_ELT(args, iarg), &n);
+			if (n > 0) {
+				memcpy(text + off, elt_text,
+				       n * sizeof(*text));
+			}
+			off += n;
+		}
+	}
+
 	UNPROTECT(nprot);
 	return ans;
 }
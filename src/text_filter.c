@@ -14,8 +14,12 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include "rcorpus.h"
 
+// maximum number of filter setups to keep in the cache
+#define FILTER_CACHE_MAX 8
+
 
 static int filter_logical(SEXP filter, const char *key, int nullval)
 {
@@ -201,13 +205,397 @@ static int add_combine(void *obj, const struct utf8lite_text *x)
 }
 
 
-struct corpus_filter *text_filter(SEXP x)
+static void stemmer_init_filter(struct stemmer *s, SEXP filter)
 {
-	SEXP handle, filter, combine, stemmer;
-	struct rcorpus_text *obj;
+	SEXP stemmer;
 	const char *snowball;
+
+	stemmer = getListElement(filter, "stemmer");
+
+	if (stemmer == R_NilValue) {
+		stemmer_init_none(s);
+	} else if (TYPEOF(stemmer) == STRSXP) {
+		snowball = filter_stemmer_snowball(stemmer);
+		stemmer_init_snowball(s, snowball);
+	} else if (isFunction(stemmer)) {
+		stemmer_init_rfunc(s, stemmer, R_GlobalEnv);
+	} else {
+		error("invalid filter 'stemmer' value");
+	}
+}
+
+
+// the filter's term lists, coerced to text by filter_terms
+enum filter_term_list {
+	TERMS_DROP = 0,
+	TERMS_STEM_EXCEPT,
+	TERMS_DROP_EXCEPT,
+	TERMS_COMBINE,
+	TERMS_COUNT
+};
+
+
+static SEXP filter_terms(SEXP filter)
+{
+	static const char *names[TERMS_COUNT] = {
+		"drop", "stem_except", "drop_except", "combine"
+	};
+	SEXP ans, sterms;
+	int k;
+
+	PROTECT(ans = allocVector(VECSXP, TERMS_COUNT));
+
+	for (k = 0; k < TERMS_COUNT; k++) {
+		sterms = getListElement(filter, names[k]);
+		if (sterms != R_NilValue) {
+			SET_VECTOR_ELT(ans, k, coerce_text(sterms));
+		}
+	}
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+// initialize a filter with its own symbol table, adding the terms from
+// filter_terms
+static void filter_init_terms(struct corpus_filter *f, int *has_filter,
+			      const struct stemmer *s, SEXP filter,
+			      SEXP terms)
+{
+	SEXP drop;
 	int32_t connector;
-	int err = 0, nprot = 0, type_kind, flags, stem_dropped;
+	int err = 0, type_kind, flags, stem_dropped;
+
+	type_kind = filter_type_kind(filter);
+	connector = filter_connector(filter);
+	flags = filter_flags(filter);
+	stem_dropped = filter_logical(filter, "stem_dropped", 0);
+	drop = VECTOR_ELT(terms, TERMS_DROP);
+
+	TRY(corpus_filter_init(f, flags, type_kind, connector, s->stem_func,
+			       s->stem_context));
+	*has_filter = 1;
+
+	if (!stem_dropped) {
+		add_terms(add_stem_except, f, drop);
+	}
+	add_terms(add_stem_except, f, VECTOR_ELT(terms, TERMS_STEM_EXCEPT));
+	add_terms(add_drop, f, drop);
+	add_terms(add_drop_except, f, VECTOR_ELT(terms, TERMS_DROP_EXCEPT));
+	add_terms(add_combine, f, VECTOR_ELT(terms, TERMS_COMBINE));
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void filter_init(struct corpus_filter *f, int *has_filter,
+			const struct stemmer *s, SEXP filter)
+{
+	SEXP terms;
+
+	PROTECT(terms = filter_terms(filter));
+	filter_init_terms(f, has_filter, s, filter, terms);
+	UNPROTECT(1);
+}
+
+
+struct stem_batch_context {
+	struct corpus_filter filter;
+	int has_filter;
+};
+
+
+static void stem_batch_context_destroy(void *obj)
+{
+	struct stem_batch_context *ctx = obj;
+
+	if (ctx->has_filter) {
+		corpus_filter_destroy(&ctx->filter);
+	}
+}
+
+
+// find the distinct words in the text using an unstemmed filter, then
+// stem them all with a single batch of calls to the stemmer
+static void stem_batch_text(struct stemmer *s, SEXP x, SEXP filter)
+{
+	SEXP sctx;
+	struct stem_batch_context *ctx;
+	const struct utf8lite_text *text;
+	struct utf8lite_text *words;
+	const struct corpus_symtab *symtab;
+	R_xlen_t i, n;
+	int err = 0, t;
+
+	text = as_text(x, &n);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx),
+				     stem_batch_context_destroy));
+	ctx = as_context(sctx);
+
+	TRY(corpus_filter_init(&ctx->filter, CORPUS_FILTER_KEEP_ALL,
+			       filter_type_kind(filter),
+			       filter_connector(filter), NULL, NULL));
+	ctx->has_filter = 1;
+
+	add_terms(add_combine, &ctx->filter, getListElement(filter, "combine"));
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (!text[i].ptr) { // missing text
+			continue;
+		}
+
+		TRY(corpus_filter_start(&ctx->filter, &text[i]));
+		while (corpus_filter_advance(&ctx->filter)) {
+			// no-op; the filter adds new types to its symtab
+		}
+		TRY(ctx->filter.error);
+	}
+
+	symtab = &ctx->filter.symtab;
+	words = (void *)R_alloc(symtab->ntype, sizeof(*words));
+	for (t = 0; t < symtab->ntype; t++) {
+		words[t] = symtab->types[t].text;
+	}
+
+	stemmer_batch(s, words, symtab->ntype);
+
+out:
+	free_context(sctx);
+	UNPROTECT(1);
+	CHECK_ERROR(err);
+}
+
+
+/*
+ * Process-wide cache of the R-side filter setup, keyed by the filter
+ * list: the drop, stem exception, and combine term lists, coerced to
+ * text, and the stemmer. Each handle still replays the terms into a
+ * filter of its own, tokenizing them and building the combine tree and
+ * property tables; those index into the handle's own symbol table, so
+ * they cannot be shared. Handles with the same entry share its stemmer;
+ * they all run on the main thread.
+ *
+ * The cache is a list in order of most recent use. Each entry has one
+ * reference from the cache and one from each handle using its stemmer.
+ */
+
+struct filter_entry {
+	struct stemmer stemmer;
+	struct filter_entry *prev, *next;
+	SEXP spec;
+	SEXP terms; // the term lists from filter_terms
+	uint64_t hash;
+	int refcount;
+	int cached;
+	int has_stemmer;
+};
+
+static struct filter_entry *filter_cache_head;
+static int filter_cache_count;
+
+
+static void hash_bytes(uint64_t *hash, const void *ptr, size_t size)
+{
+	const uint8_t *bytes = ptr;
+	size_t i;
+
+	// FNV-1a
+	for (i = 0; i < size; i++) {
+		*hash ^= bytes[i];
+		*hash *= 0x100000001b3;
+	}
+}
+
+
+// hash the filter list; returns zero if it contains a value that can't
+// be cached, like an R stemming function
+static int filter_hash(SEXP x, uint64_t *hash)
+{
+	SEXP str;
+	R_xlen_t i, n;
+	int type = TYPEOF(x), len;
+
+	hash_bytes(hash, &type, sizeof(type));
+	if (x == R_NilValue) {
+		return 1;
+	}
+
+	n = XLENGTH(x);
+	hash_bytes(hash, &n, sizeof(n));
+
+	switch (type) {
+	case LGLSXP:
+		hash_bytes(hash, LOGICAL(x), n * sizeof(*LOGICAL(x)));
+		break;
+
+	case INTSXP:
+		hash_bytes(hash, INTEGER(x), n * sizeof(*INTEGER(x)));
+		break;
+
+	case REALSXP:
+		hash_bytes(hash, REAL(x), n * sizeof(*REAL(x)));
+		break;
+
+	case STRSXP:
+		for (i = 0; i < n; i++) {
+			str = STRING_ELT(x, i);
+			len = (str == NA_STRING) ? -1 : LENGTH(str);
+			hash_bytes(hash, &len, sizeof(len));
+			if (len > 0) {
+				hash_bytes(hash, CHAR(str), (size_t)len);
+			}
+		}
+		break;
+
+	case VECSXP:
+		for (i = 0; i < n; i++) {
+			if (!filter_hash(VECTOR_ELT(x, i), hash)) {
+				return 0;
+			}
+		}
+		break;
+
+	default:
+		return 0;
+	}
+
+	return filter_hash(getAttrib(x, R_NamesSymbol), hash);
+}
+
+
+static void filter_cache_unlink(struct filter_entry *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		filter_cache_head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+
+void filter_entry_release(struct filter_entry *entry)
+{
+	if (!entry || --entry->refcount > 0) {
+		return;
+	}
+
+	if (entry->has_stemmer) {
+		stemmer_destroy(&entry->stemmer);
+	}
+	corpus_free(entry);
+}
+
+
+// remove the entry from the cache; handles using it keep it alive
+static void filter_cache_evict(struct filter_entry *entry)
+{
+	if (!entry->cached) {
+		return;
+	}
+
+	filter_cache_unlink(entry);
+	entry->cached = 0;
+	filter_cache_count--;
+	R_ReleaseObject(entry->spec);
+	entry->spec = R_NilValue;
+	if (entry->terms != R_NilValue) {
+		R_ReleaseObject(entry->terms);
+		entry->terms = R_NilValue;
+	}
+	filter_entry_release(entry);
+}
+
+
+// get the setup for 'filter', building it on a cache miss; returns NULL
+// if the filter can't be cached
+static struct filter_entry *filter_cache_get(SEXP filter)
+{
+	SEXP terms;
+	struct filter_entry *entry, *last;
+	uint64_t hash = 0xcbf29ce484222325;
+	int err = 0;
+
+	if (!filter_hash(filter, &hash)) {
+		return NULL;
+	}
+
+	for (entry = filter_cache_head; entry; entry = entry->next) {
+		if (entry->hash != hash) {
+			continue;
+		}
+		if (R_compute_identical(entry->spec, filter, 16)) {
+			break;
+		}
+	}
+
+	if (entry && !(entry->has_stemmer && entry->terms != R_NilValue
+			&& !entry->stemmer.error)) {
+		// a previous setup failed
+		filter_cache_evict(entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		// move to the front
+		filter_cache_unlink(entry);
+	} else {
+		if (filter_cache_count == FILTER_CACHE_MAX) {
+			last = filter_cache_head;
+			while (last->next) {
+				last = last->next;
+			}
+			filter_cache_evict(last);
+		}
+
+		TRY_ALLOC(entry = corpus_calloc(1, sizeof(*entry)));
+		R_PreserveObject(filter);
+		entry->spec = filter;
+		entry->terms = R_NilValue;
+		entry->hash = hash;
+		entry->refcount = 1;
+		entry->cached = 1;
+		filter_cache_count++;
+	}
+
+	entry->next = filter_cache_head;
+	if (filter_cache_head) {
+		filter_cache_head->prev = entry;
+	}
+	filter_cache_head = entry;
+
+	// on error, the entry stays in the cache, and the next lookup
+	// evicts it
+	if (!entry->has_stemmer) {
+		stemmer_init_filter(&entry->stemmer, filter);
+		entry->has_stemmer = 1;
+	}
+	if (entry->terms == R_NilValue) {
+		terms = filter_terms(filter);
+		R_PreserveObject(terms);
+		entry->terms = terms;
+	}
+
+	entry->refcount++;
+out:
+	CHECK_ERROR(err);
+	return entry;
+}
+
+
+struct corpus_filter *text_filter(SEXP x)
+{
+	SEXP handle, filter;
+	struct rcorpus_text *obj;
+	struct filter_entry *entry;
 
 	handle = getListElement(x, "handle");
 	obj = R_ExternalPtrAddr(handle);
@@ -216,6 +604,9 @@ struct corpus_filter *text_filter(SEXP x)
 	if (obj->has_stemmer && obj->stemmer.error) {
 		obj->valid_filter = 0;
 	}
+	if (obj->cached_filter && obj->cached_filter->stemmer.error) {
+		obj->valid_filter = 0;
+	}
 
 	if (obj->has_filter) {
 		if (obj->valid_filter && !obj->filter.error) {
@@ -231,12 +622,34 @@ struct corpus_filter *text_filter(SEXP x)
 	}
 	obj->valid_filter = 0;
 
+	if (obj->cached_filter) {
+		entry = obj->cached_filter;
+		if (entry->stemmer.error) {
+			// keep other handles from getting the broken stemmer
+			filter_cache_evict(entry);
+		}
+		filter_entry_release(entry);
+		obj->cached_filter = NULL;
+	}
+
+	// cached type IDs refer to the old filter's symbol table
+	token_cache_destroy(&obj->tokens);
+	obj->has_tokens = 0;
+
 	filter = getListElement(x, "filter");
-	type_kind = filter_type_kind(filter);
-	combine = getListElement(filter, "combine");
-	connector = filter_connector(filter);
-	flags = filter_flags(filter);
-	stem_dropped = filter_logical(filter, "stem_dropped", 0);
+
+	obj->cached_filter = filter_cache_get(filter);
+	if (obj->cached_filter) {
+		entry = obj->cached_filter;
+		if (obj->has_stemmer) {
+			stemmer_destroy(&obj->stemmer);
+			obj->has_stemmer = 0;
+		}
+		filter_init_terms(&obj->filter, &obj->has_filter,
+				  &entry->stemmer, filter, entry->terms);
+		obj->valid_filter = 1;
+		return &obj->filter;
+	}
 
 	if (obj->has_stemmer && obj->stemmer.error) {
 		stemmer_destroy(&obj->stemmer);
@@ -244,44 +657,231 @@ struct corpus_filter *text_filter(SEXP x)
 	}
 
 	if (!obj->has_stemmer) {
-		stemmer = getListElement(filter, "stemmer");
-		
-		if (stemmer == R_NilValue) {
-			stemmer_init_none(&obj->stemmer);
-		} else if (TYPEOF(stemmer) == STRSXP) {
-			snowball = filter_stemmer_snowball(stemmer);
-			stemmer_init_snowball(&obj->stemmer, snowball);
-		} else if (isFunction(stemmer)) {
-			stemmer_init_rfunc(&obj->stemmer, stemmer,
-					   R_GlobalEnv);
-		} else {
-			error("invalid filter 'stemmer' value");
+		stemmer_init_filter(&obj->stemmer, filter);
+		obj->has_stemmer = 1;
+	}
+
+	if (obj->stemmer.type == STEMMER_RFUNC
+			&& filter_logical(filter, "stem_batch", 0)) {
+		stem_batch_text(&obj->stemmer, x, filter);
+	}
+
+	filter_init(&obj->filter, &obj->has_filter, &obj->stemmer, filter);
+	obj->valid_filter = 1;
+	return &obj->filter;
+}
+
+
+int text_filter_can_clone(SEXP x)
+{
+	SEXP filter, stemmer;
+
+	filter = getListElement(x, "filter");
+	stemmer = getListElement(filter, "stemmer");
+
+	// R stemming functions cannot run outside the main thread
+	return !(stemmer != R_NilValue && isFunction(stemmer));
+}
+
+
+// the clone gets its own stemmer, for use on another thread, but it
+// takes the coerced term lists from the cache
+void text_filter_clone_init(struct filter_clone *clone, SEXP x)
+{
+	SEXP filter;
+	struct filter_entry *entry;
+
+	if (!text_filter_can_clone(x)) {
+		error("cannot clone a text filter with an R stemming function");
+	}
+
+	filter = getListElement(x, "filter");
+
+	stemmer_init_filter(&clone->stemmer, filter);
+	clone->has_stemmer = 1;
+
+	entry = filter_cache_get(filter);
+	if (entry) {
+		filter_init_terms(&clone->filter, &clone->has_filter,
+				  &clone->stemmer, filter, entry->terms);
+		filter_entry_release(entry);
+	} else {
+		filter_init(&clone->filter, &clone->has_filter,
+			    &clone->stemmer, filter);
+	}
+}
+
+
+void text_filter_clone_destroy(struct filter_clone *clone)
+{
+	if (clone->has_filter) {
+		corpus_filter_destroy(&clone->filter);
+		clone->has_filter = 0;
+	}
+
+	if (clone->has_stemmer) {
+		stemmer_destroy(&clone->stemmer);
+		clone->has_stemmer = 0;
+	}
+}
+
+
+void token_cache_destroy(struct token_cache *cache)
+{
+	corpus_free(cache->offset);
+	cache->offset = NULL;
+
+	corpus_free(cache->start);
+	cache->start = NULL;
+
+	corpus_free(cache->type_id);
+	cache->type_id = NULL;
+
+	cache->ntoken = 0;
+	cache->ntoken_max = 0;
+}
+
+
+static void token_cache_grow(struct token_cache *cache, R_xlen_t nadd)
+{
+	int *type_id, *start;
+	size_t count, size, width;
+	int err = 0;
+
+	count = (size_t)cache->ntoken;
+	size = (size_t)cache->ntoken_max;
+	width = sizeof(*type_id) + sizeof(*start);
+
+	if ((size_t)nadd <= size && count <= size - (size_t)nadd) {
+		return;
+	}
+
+	TRY(corpus_bigarray_size_add(&size, width, count, (size_t)nadd));
+
+	TRY_ALLOC(type_id = corpus_realloc(cache->type_id,
+					   size * sizeof(*type_id)));
+	cache->type_id = type_id;
+
+	TRY_ALLOC(start = corpus_realloc(cache->start, size * sizeof(*start)));
+	cache->start = start;
+
+	cache->ntoken_max = (R_xlen_t)size;
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void token_cache_trim(struct token_cache *cache)
+{
+	int *type_id, *start;
+	size_t size = (size_t)cache->ntoken;
+
+	if (size == 0 || size == (size_t)cache->ntoken_max) {
+		return;
+	}
+
+	type_id = corpus_realloc(cache->type_id, size * sizeof(*type_id));
+	if (type_id) {
+		cache->type_id = type_id;
+	}
+
+	start = corpus_realloc(cache->start, size * sizeof(*start));
+	if (start) {
+		cache->start = start;
+	}
+
+	if (type_id && start) {
+		cache->ntoken_max = (R_xlen_t)size;
+	}
+}
+
+
+int text_has_token_cache(SEXP x)
+{
+	SEXP handle;
+	struct rcorpus_text *obj;
+
+	handle = getListElement(x, "handle");
+	obj = R_ExternalPtrAddr(handle);
+
+	if (!(obj && obj->has_tokens && obj->valid_filter)) {
+		return 0;
+	}
+
+	if (obj->cached_filter && obj->cached_filter->stemmer.error) {
+		return 0;
+	}
+
+	return (!obj->filter.error
+		&& !(obj->has_stemmer && obj->stemmer.error));
+}
+
+
+const struct token_cache *text_token_cache(SEXP x)
+{
+	SEXP handle;
+	struct rcorpus_text *obj;
+	struct corpus_filter *filter;
+	struct token_cache *cache;
+	const struct utf8lite_text *text;
+	R_xlen_t i, n;
+	int err = 0;
+
+	text = as_text(x, &n);
+	filter = text_filter(x);
+
+	handle = getListElement(x, "handle");
+	obj = R_ExternalPtrAddr(handle);
+	cache = &obj->tokens;
+
+	if (obj->has_tokens) {
+		return cache;
+	}
+
+	// discard the remains of an interrupted build
+	token_cache_destroy(cache);
+
+	TRY_ALLOC(cache->offset = corpus_malloc((size_t)(n + 1)
+						* sizeof(*cache->offset)));
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		cache->offset[i] = cache->ntoken;
+
+		if (!text[i].ptr) { // missing text
+			continue;
 		}
 
-		obj->has_stemmer = 1;
+		TRY(corpus_filter_start(filter, &text[i]));
+
+		while (corpus_filter_advance(filter)) {
+			if (filter->type_id == CORPUS_TYPE_NONE) {
+				continue;
+			}
+
+			if (cache->ntoken == cache->ntoken_max) {
+				token_cache_grow(cache, 1);
+			}
+
+			cache->type_id[cache->ntoken] = filter->type_id;
+			cache->start[cache->ntoken] =
+				(int)(filter->current.ptr - text[i].ptr);
+			cache->ntoken++;
+		}
+		TRY(filter->error);
 	}
+	cache->offset[n] = cache->ntoken;
 
-	TRY(corpus_filter_init(&obj->filter, flags, type_kind,
-			       connector, obj->stemmer.stem_func,
-			       obj->stemmer.stem_context));
-	obj->has_filter = 1;
+	token_cache_trim(cache);
+	obj->has_tokens = 1;
 
-	if (!stem_dropped) {
-		add_terms(add_stem_except, &obj->filter,
-			  getListElement(filter, "drop"));
-	}
-	add_terms(add_stem_except, &obj->filter,
-		  getListElement(filter, "stem_except"));
-add_terms(add_drop, &obj->filter,
-		  getListElement(filter, "drop"));
-	add_terms(add_drop_except, &obj->filter,
-		  getListElement(filter, "drop_except"));
-	add_terms(add_combine, &obj->filter, combine);
 out:
-	UNPROTECT(nprot);
+	if (err) {
+		token_cache_destroy(cache);
+	}
 	CHECK_ERROR(err);
-	obj->valid_filter = 1;
-	return &obj->filter;
+	return cache;
 }
 
 
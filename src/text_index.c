@@ -0,0 +1,552 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "rcorpus.h"
+
+#define TEXT_INDEX_TAG install("corpus::text_index")
+
+// number of postings in a block; a search can skip a whole block
+// without decoding it
+#define INDEX_BLOCK_SIZE 128
+
+/*
+ * The index has a posting (text ID, token position) for each token in
+ * the text's cached token stream, grouped by type. Positions skip the
+ * dropped tokens, so that the texts matching a phrase are a superset of
+ * the ones the search finds. Each type's postings
+ * are in increasing order, split into blocks. A block header stores the
+ * first posting; the rest of the block's postings are delta-encoded
+ * as variable-length integers:
+ *
+ *     text gap; position gap (same text) or position (new text)
+ */
+
+struct index_block {
+	size_t offset;	// start of the block's encoded postings in 'data'
+	int text_id;	// first posting in the block
+	int position;
+};
+
+struct text_index {
+	uint8_t *data;
+	struct index_block *blocks;
+	R_xlen_t *block_start;	// type t has blocks block_start[t], ...,
+				// block_start[t + 1] - 1
+	R_xlen_t *count;	// number of postings for each type
+	size_t size;
+	int ntype;
+	int ntext;
+};
+
+// a position in a type's postings
+struct index_cursor {
+	const struct text_index *index;
+	const uint8_t *ptr;
+	R_xlen_t block, block_end;
+	R_xlen_t count;	// number of postings for the type
+	int left;	// postings left in the block, after the current one
+	int text_id;	// current posting, or INT_MAX after the last
+	int position;
+};
+
+
+static int varint_size(unsigned x)
+{
+	int size = 1;
+
+	while (x >= 0x80) {
+		x >>= 7;
+		size++;
+	}
+	return size;
+}
+
+
+static uint8_t *varint_encode(uint8_t *ptr, unsigned x)
+{
+	while (x >= 0x80) {
+		*ptr++ = (uint8_t)(x | 0x80);
+		x >>= 7;
+	}
+	*ptr++ = (uint8_t)x;
+	return ptr;
+}
+
+
+static const uint8_t *varint_decode(const uint8_t *ptr, unsigned *xptr)
+{
+	unsigned x = 0;
+	int shift = 0;
+
+	while (*ptr & 0x80) {
+		x |= (unsigned)(*ptr++ & 0x7F) << shift;
+		shift += 7;
+	}
+	x |= (unsigned)(*ptr++) << shift;
+
+	*xptr = x;
+	return ptr;
+}
+
+
+static void text_index_free(struct text_index *obj)
+{
+	if (!obj) {
+		return;
+	}
+
+	corpus_free(obj->count);
+	corpus_free(obj->block_start);
+	corpus_free(obj->blocks);
+	corpus_free(obj->data);
+	corpus_free(obj);
+}
+
+
+static void free_text_index(SEXP sindex)
+{
+	struct text_index *obj = R_ExternalPtrAddr(sindex);
+	text_index_free(obj);
+	R_ClearExternalPtr(sindex);
+}
+
+
+int is_text_index(SEXP sindex)
+{
+	return ((TYPEOF(sindex) == EXTPTRSXP)
+		&& (R_ExternalPtrTag(sindex) == TEXT_INDEX_TAG));
+}
+
+
+struct text_index *as_text_index(SEXP sindex)
+{
+	struct text_index *obj;
+
+	if (!is_text_index(sindex)) {
+		Rf_error("invalid 'text_index' object");
+	}
+
+	obj = R_ExternalPtrAddr(sindex);
+	if (!obj) {
+		Rf_error("text index has been freed");
+	}
+
+	return obj;
+}
+
+
+// the state for each type while building the index
+struct index_build {
+	size_t *size;	// encoded size, then write offset
+	int *text_id;	// last posting
+	int *position;
+	R_xlen_t *count;
+};
+
+
+static void index_build_destroy(void *obj)
+{
+	struct index_build *b = obj;
+
+	corpus_free(b->count);
+	corpus_free(b->position);
+	corpus_free(b->text_id);
+	corpus_free(b->size);
+}
+
+
+// the number of bytes needed to encode a posting that follows
+// (text_id0, position0), or 0 if the posting starts a new block
+static int posting_size(R_xlen_t count, int text_id0, int position0,
+			int text_id, int position)
+{
+	if (count % INDEX_BLOCK_SIZE == 0) {
+		return 0;
+	}
+
+	if (text_id == text_id0) {
+		return 1 + varint_size((unsigned)(position - position0));
+	}
+
+	return (varint_size((unsigned)(text_id - text_id0))
+		+ varint_size((unsigned)position));
+}
+
+
+SEXP text_index(SEXP sx)
+{
+	SEXP ans, sbuild;
+	const struct token_cache *tokens;
+	const struct corpus_filter *filter;
+	struct index_build *b;
+	struct index_block *block;
+	struct text_index *obj;
+	uint8_t *ptr;
+	size_t off, size;
+	R_xlen_t i, k, nblock, ntext, t;
+	int err = 0, nprot = 0, ntype, position, type_id;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	as_text(sx, &ntext);
+
+	if (ntext > INT_MAX) {
+		Rf_error("number of texts (%"PRIu64") exceeds maximum (%d)",
+			 (uint64_t)ntext, INT_MAX);
+	}
+
+	tokens = text_token_cache(sx);
+	filter = text_filter(sx);
+	ntype = filter->symtab.ntype;
+
+	PROTECT(ans = R_MakeExternalPtr(NULL, TEXT_INDEX_TAG, R_NilValue));
+	nprot++;
+	R_RegisterCFinalizerEx(ans, free_text_index, TRUE);
+
+	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+	R_SetExternalPtrAddr(ans, obj);
+	obj->ntype = ntype;
+	obj->ntext = (int)ntext;
+
+	PROTECT(sbuild = alloc_context(sizeof(*b), index_build_destroy));
+	nprot++;
+	b = as_context(sbuild);
+
+	TRY_ALLOC(b->size = corpus_calloc(ntype + 1, sizeof(*b->size)));
+	TRY_ALLOC(b->text_id = corpus_calloc(ntype + 1,
+					     sizeof(*b->text_id)));
+	TRY_ALLOC(b->position = corpus_calloc(ntype + 1,
+					      sizeof(*b->position)));
+	TRY_ALLOC(b->count = corpus_calloc(ntype + 1, sizeof(*b->count)));
+
+	// size the encoded postings for each type
+	for (i = 0; i < ntext; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		position = -1;
+		for (k = tokens->offset[i]; k < tokens->offset[i + 1]; k++) {
+			if ((type_id = tokens->type_id[k]) < 0) {
+				continue;
+			}
+			position++;
+
+			b->size[type_id] += posting_size(
+				b->count[type_id], b->text_id[type_id],
+				b->position[type_id], (int)i, position);
+			b->text_id[type_id] = (int)i;
+			b->position[type_id] = position;
+			b->count[type_id]++;
+		}
+	}
+
+	TRY_ALLOC(obj->block_start = corpus_malloc((ntype + 1)
+					* sizeof(*obj->block_start)));
+
+	nblock = 0;
+	size = 0;
+	for (t = 0; t < ntype; t++) {
+		obj->block_start[t] = nblock;
+		nblock += (b->count[t] + INDEX_BLOCK_SIZE - 1)
+			/ INDEX_BLOCK_SIZE;
+
+		// change the size to a write offset
+		off = b->size[t];
+		b->size[t] = size;
+		TRY(off > SIZE_MAX - size ? CORPUS_ERROR_OVERFLOW : 0);
+		size += off;
+	}
+	obj->block_start[ntype] = nblock;
+
+	TRY_ALLOC(obj->blocks = corpus_malloc((nblock + 1)
+					      * sizeof(*obj->blocks)));
+	TRY_ALLOC(obj->data = corpus_malloc(size + 1));
+	obj->size = size;
+
+	// encode the postings
+	memset(b->count, 0, (ntype + 1) * sizeof(*b->count));
+
+	for (i = 0; i < ntext; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		position = -1;
+		for (k = tokens->offset[i]; k < tokens->offset[i + 1]; k++) {
+			if ((type_id = tokens->type_id[k]) < 0) {
+				continue;
+			}
+			position++;
+			ptr = obj->data + b->size[type_id];
+
+			if (b->count[type_id] % INDEX_BLOCK_SIZE == 0) {
+				nblock = (obj->block_start[type_id]
+					  + b->count[type_id]
+					  / INDEX_BLOCK_SIZE);
+				block = &obj->blocks[nblock];
+				block->offset = b->size[type_id];
+				block->text_id = (int)i;
+				block->position = position;
+			} else if (b->text_id[type_id] == (int)i) {
+				ptr = varint_encode(ptr, 0);
+				ptr = varint_encode(ptr, (unsigned)(position
+						- b->position[type_id]));
+			} else {
+				ptr = varint_encode(ptr, (unsigned)((int)i
+						- b->text_id[type_id]));
+				ptr = varint_encode(ptr, (unsigned)position);
+			}
+
+			b->size[type_id] = (size_t)(ptr - obj->data);
+			b->text_id[type_id] = (int)i;
+			b->position[type_id] = position;
+			b->count[type_id]++;
+		}
+	}
+
+	// keep the posting counts; free the rest of the build state
+	obj->count = b->count;
+	b->count = NULL;
+
+out:
+	CHECK_ERROR(err);
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+static void cursor_load(struct index_cursor *c, R_xlen_t block)
+{
+	const struct text_index *index = c->index;
+	const struct index_block *b;
+	R_xlen_t nblock;
+
+	c->block = block;
+	if (block >= c->block_end) {
+		c->ptr = NULL;
+		c->left = 0;
+		c->text_id = INT_MAX;
+		c->position = 0;
+		return;
+	}
+
+	b = &index->blocks[block];
+	c->ptr = index->data + b->offset;
+	c->text_id = b->text_id;
+	c->position = b->position;
+
+	// the last block may be partial
+	nblock = c->block_end - (block + 1);
+	if (nblock > 0) {
+		c->left = INDEX_BLOCK_SIZE - 1;
+	} else {
+		c->left = (int)((c->count - 1) % INDEX_BLOCK_SIZE);
+	}
+}
+
+
+static void cursor_init(struct index_cursor *c,
+			const struct text_index *index, int type_id)
+{
+	c->index = index;
+	c->block_end = index->block_start[type_id + 1];
+	c->count = index->count[type_id];
+	cursor_load(c, index->block_start[type_id]);
+}
+
+
+static void cursor_next(struct index_cursor *c)
+{
+	unsigned gap, x;
+
+	if (c->left == 0) {
+		cursor_load(c, c->block + 1);
+		return;
+	}
+
+	c->ptr = varint_decode(c->ptr, &gap);
+	c->ptr = varint_decode(c->ptr, &x);
+
+	if (gap == 0) {
+		c->position += (int)x;
+	} else {
+		c->text_id += (int)gap;
+		c->position = (int)x;
+	}
+	c->left--;
+}
+
+
+#define POSTING_LESS(text_id1, position1, text_id2, position2) \
+	((text_id1) < (text_id2) \
+	 || ((text_id1) == (text_id2) && (position1) < (position2)))
+
+
+// advance to the first posting at or after (text_id, position)
+static void cursor_seek(struct index_cursor *c, int text_id, int position)
+{
+	const struct index_block *blocks = c->index->blocks;
+	R_xlen_t lo, hi, mid;
+
+	if (!POSTING_LESS(c->text_id, c->position, text_id, position)) {
+		return;
+	}
+
+	// find the last block starting at or before the target
+	lo = c->block;
+	hi = c->block_end;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (POSTING_LESS(text_id, position, blocks[mid].text_id,
+				 blocks[mid].position)) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+
+	if (lo != c->block) {
+		cursor_load(c, lo);
+	}
+
+	while (POSTING_LESS(c->text_id, c->position, text_id, position)) {
+		cursor_next(c);
+	}
+}
+
+
+// mark the texts that contain a single-type term
+static void index_mark_type(const struct text_index *index, int type_id,
+			    uint8_t *hit)
+{
+	struct index_cursor c;
+
+	cursor_init(&c, index, type_id);
+
+	while (c.text_id != INT_MAX) {
+		hit[c.text_id] = 1;
+		cursor_seek(&c, c.text_id + 1, 0);
+	}
+}
+
+
+// mark the texts that contain a multi-type term, with its types in
+// consecutive positions; drive the search with the rarest type, and
+// leapfrog over the postings that cannot match
+static void index_mark_phrase(const struct text_index *index,
+			      const int *type_ids, int length,
+			      struct index_cursor *cursor, uint8_t *hit)
+{
+	struct index_cursor *drive;
+	int j, k, start, text_id, match;
+
+	j = 0;
+	for (k = 0; k < length; k++) {
+		cursor_init(&cursor[k], index, type_ids[k]);
+		if (index->count[type_ids[k]] < index->count[type_ids[j]]) {
+			j = k;
+		}
+	}
+	drive = &cursor[j];
+
+	while (drive->text_id != INT_MAX) {
+		text_id = drive->text_id;
+		start = drive->position - j;
+
+		if (start < 0) {
+			cursor_next(drive);
+			continue;
+		}
+
+		match = 1;
+		for (k = 0; k < length; k++) {
+			if (k == j) {
+				continue;
+			}
+
+			cursor_seek(&cursor[k], text_id, start + k);
+			if (cursor[k].text_id != text_id
+					|| cursor[k].position != start + k) {
+				match = 0;
+				break;
+			}
+		}
+
+		if (match) {
+			hit[text_id] = 1;
+			cursor_seek(drive, text_id + 1, 0);
+		} else if (cursor[k].text_id == INT_MAX) {
+			break;
+		} else {
+			// skip ahead to the next possible start; it comes
+			// after the current one
+			start = cursor[k].position - k;
+			if (start < 0) {
+				start = 0;
+			}
+			cursor_seek(drive, cursor[k].text_id, start + j);
+		}
+	}
+}
+
+
+// mark the texts that contain at least one of the terms
+void text_index_mark(const struct text_index *index,
+		     const struct corpus_termset *terms, uint8_t *hit)
+{
+	const struct corpus_termset_term *term;
+	struct index_cursor *cursor;
+	int i, k, found, max_length;
+
+	max_length = 1;
+	for (i = 0; i < terms->nitem; i++) {
+		if (terms->items[i].length > max_length) {
+			max_length = terms->items[i].length;
+		}
+	}
+	cursor = (void *)R_alloc(max_length, sizeof(*cursor));
+
+	for (i = 0; i < terms->nitem; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		term = &terms->items[i];
+
+		// skip terms with types that are not in the index
+		found = 1;
+		for (k = 0; k < term->length; k++) {
+			if (term->type_ids[k] >= index->ntype
+					|| !index->count[term->type_ids[k]]) {
+				found = 0;
+				break;
+			}
+		}
+		if (!found) {
+			continue;
+		}
+
+		if (term->length == 1) {
+			index_mark_type(index, term->type_ids[0], hit);
+		} else {
+			index_mark_phrase(index, term->type_ids,
+					  term->length, cursor, hit);
+		}
+	}
+}
+
+
+int text_index_ntext(const struct text_index *index)
+{
+	return index->ntext;
+}
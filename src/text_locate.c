@@ -14,274 +14,1017 @@
  * limitations under the License.
  */
 
+#include <inttypes.h>
+#include <math.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "rcorpus.h"
+#include <R_ext/Random.h>
 
 
-struct locate_item {
+// a dictionary category's total for one text
+struct dict_entry {
 	int text_id;
-	int term_id;
-	struct utf8lite_text instance;
+	int category;
+	double count;
+	double score;
 };
 
 
-struct locate {
-	struct locate_item *items;
-	int nitem;
-	int nitem_max;
+enum search_kind {
+	SEARCH_COUNT = 0,
+	SEARCH_DETECT,
+	SEARCH_LOCATE,
+	SEARCH_DICTIONARY,
+	SEARCH_SAMPLE
 };
 
 
-static void locate_init(struct locate *loc);
-static void locate_add(struct locate *loc, int text_id, int term_id,
-		       const struct utf8lite_text *instance);
-static void locate_grow(struct locate *loc, int nadd);
+struct search_worker {
+	struct filter_clone clone;
+	struct corpus_filter *filter;
+	struct corpus_search *search;
+	struct locate loc;
+	struct dict_entry *entries; // category totals, in text order
+	double *cat_count; // current text's count for each category
+	double *cat_score; // current text's score for each category
+	int *touched; // categories with nonzero count
+	int *token_start; // current text's token spans, for the windows
+	int *token_end;
+	double nseen; // matches seen so far, for the sample reservoir
+	R_xlen_t begin, end;
+	int nentry, nentry_max;
+	int ntoken, ntoken_max;
+	int ntouched;
+	int has_clone;
+	int error;
+};
+
+
+struct search_context {
+	struct search_worker *worker;
+	double *count;
+	int *detect;
+	const uint8_t *candidate; // texts that can match, or NULL for all
+	const int *source; // input term for each search term
+	const int *category; // category for each term (1-based)
+	const double *weight; // weight for each term, or NULL
+	int ncategory;
+	int kind;
+	int nworker;
+	int window; // tokens of context around each instance, or -1 for all
+	int size; // sample reservoir size, or -1 for all matches
+};
+
+
+static void locate_destroy(struct locate *loc);
+static int locate_add(struct locate *loc, int text_id, int term_id,
+		      const struct utf8lite_text *instance);
+static int locate_grow(struct locate *loc, int nadd);
 SEXP make_matches(struct locate *loc, SEXP terms);
-SEXP make_instances(struct locate *loc, SEXP sx,
-		    const struct utf8lite_text *text);
 
 
-void locate_init(struct locate *loc)
+void locate_destroy(struct locate *loc)
 {
+	corpus_free(loc->items);
 	loc->items = NULL;
 	loc->nitem = 0;
 	loc->nitem_max = 0;
 }
 
 
-void locate_add(struct locate *loc, int text_id, int term_id,
-		const struct utf8lite_text *instance)
+// runs without the R API; safe to call from a worker thread
+int locate_add(struct locate *loc, int text_id, int term_id,
+	       const struct utf8lite_text *instance)
 {
-	int id;
+	int err = 0, id;
 
 	if (loc->nitem == loc->nitem_max) {
-		locate_grow(loc, 1);
+		TRY(locate_grow(loc, 1));
 	}
 
 	id = loc->nitem;
 	loc->items[id].text_id = text_id;
 	loc->items[id].term_id = term_id;
 	loc->items[id].instance = *instance;
+	loc->items[id].before = -1;
+	loc->items[id].after = -1;
 	loc->nitem++;
+out:
+	return err;
 }
 
 
-void locate_grow(struct locate *loc, int nadd)
+int locate_grow(struct locate *loc, int nadd)
 {
-	char *base = (char *)loc->items;
+	void *items;
 	size_t width = sizeof(*loc->items);
-        int size = loc->nitem_max;
-        int err;
+	int size = loc->nitem_max;
+	int err = 0;
 
 	if (nadd <= size - loc->nitem) {
+		goto out;
+	}
+
+	TRY(corpus_array_size_add(&size, width, loc->nitem, nadd));
+	TRY_ALLOC(items = corpus_realloc(loc->items, size * width));
+
+	loc->items = items;
+	loc->nitem_max = size;
+out:
+	return err;
+}
+
+
+static void search_context_destroy(void *obj)
+{
+	struct search_context *ctx = obj;
+	struct search_worker *wk;
+	int w;
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		locate_destroy(&wk->loc);
+		corpus_free(wk->entries);
+		corpus_free(wk->cat_count);
+		corpus_free(wk->cat_score);
+		corpus_free(wk->touched);
+		corpus_free(wk->token_start);
+		corpus_free(wk->token_end);
+
+		if (wk->has_clone) {
+			text_filter_clone_destroy(&wk->clone);
+		}
+	}
+
+	corpus_free(ctx->worker);
+}
+
+
+// the maximum edit distance for fuzzy terms; 0 for exact matching
+static int as_max_dist(SEXP smax_dist)
+{
+	if (smax_dist == R_NilValue) {
+		return 0;
+	}
+	return INTEGER(smax_dist)[0];
+}
+
+
+// set up the workers, each with a contiguous block of texts; with more
+// than one worker, each gets its own copy of the filter and search
+static SEXP alloc_search_context(SEXP sx, SEXP sterms, const char *name,
+				 int kind, int max_dist, SEXP sthreads)
+{
+	SEXP ans, ssearch, sset;
+	struct search_context *ctx;
+	struct search_worker *wk;
+	R_xlen_t n;
+	int allow_dup, err = 0, nthread, w;
+
+	as_text(sx, &n);
+
+	// a dictionary term has one category and one weight, so reject terms
+	// that have the same type
+	allow_dup = (kind != SEARCH_DICTIONARY);
+
+	// R stemming functions cannot run outside the main thread
+	nthread = as_nthread(sthreads, n);
+	if (!text_filter_can_clone(sx)) {
+		nthread = 1;
+	}
+
+	// term patterns and fuzzy terms resolve against the main filter's
+	// types
+	if (max_dist > 0 || termset_has_pattern(sterms)) {
+		nthread = 1;
+	}
+
+	// the sample reservoir draws from R's random number generator
+	if (kind == SEARCH_SAMPLE) {
+		nthread = 1;
+	}
+
+	PROTECT(ans = alloc_context(sizeof(*ctx), search_context_destroy));
+	ctx = as_context(ans);
+	ctx->kind = kind;
+	ctx->window = -1;
+	ctx->size = -1;
+
+	TRY_ALLOC(ctx->worker = corpus_calloc(nthread, sizeof(*ctx->worker)));
+	ctx->nworker = nthread;
+
+	PROTECT(ssearch = allocVector(VECSXP, nthread));
+	R_SetExternalPtrProtected(ans, ssearch);
+	UNPROTECT(1);
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		wk->begin = (R_xlen_t)(((double)n * w) / ctx->nworker);
+		wk->end = (R_xlen_t)(((double)n * (w + 1)) / ctx->nworker);
+
+		if (ctx->nworker == 1) {
+			wk->filter = text_filter(sx);
+			PROTECT(sset = alloc_text_termset(sterms, name, sx,
+							  max_dist,
+							  allow_dup));
+		} else {
+			text_filter_clone_init(&wk->clone, sx);
+			wk->has_clone = 1;
+			wk->filter = &wk->clone.filter;
+			PROTECT(sset = alloc_termset(sterms, name,
+						     wk->filter, allow_dup));
+		}
+
+		SET_VECTOR_ELT(ssearch, w, alloc_search(sset));
+		wk->search = as_search(VECTOR_ELT(ssearch, w));
+		UNPROTECT(1);
+	}
+
+	// the workers' term sets are the same, so they share the sources
+	ctx->source = source_search(VECTOR_ELT(ssearch, 0));
+out:
+	CHECK_ERROR(err);
+	UNPROTECT(1);
+	return ans;
+}
+
+
+// use the index to find the texts that contain the terms, so that the
+// search can skip the rest
+static void search_context_index(SEXP sctx, SEXP sx, SEXP sterms,
+				 const char *name, SEXP sindex)
+{
+	SEXP sset;
+	struct search_context *ctx = as_context(sctx);
+	const struct text_index *index;
+	uint8_t *candidate;
+	R_xlen_t n;
+
+	if (sindex == R_NilValue) {
 		return;
 	}
 
-        TRY(corpus_array_size_add(&size, width, loc->nitem, nadd));
+	index = as_text_index(sindex);
+	as_text(sx, &n);
+	if (n != text_index_ntext(index)) {
+		Rf_error("text index does not match the text");
+	}
 
-	if (loc->nitem_max > 0) {
-		loc->items = (void *)S_realloc(base, size, loc->nitem_max,
-					       width);
+	// a single worker's term set uses the main filter's types, with any
+	// patterns already resolved; otherwise the terms have no patterns
+	if (ctx->nworker == 1) {
+		sset = R_ExternalPtrProtected(
+			VECTOR_ELT(R_ExternalPtrProtected(sctx), 0));
+		PROTECT(sset);
 	} else {
-		loc->items = (void *)R_alloc(size, width);
+		PROTECT(sset = alloc_text_termset(sterms, name, sx, 0, 1));
+	}
+
+	candidate = (void *)R_alloc(n + 1, sizeof(*candidate));
+	memset(candidate, 0, (n + 1) * sizeof(*candidate));
+	text_index_mark(index, &as_termset(sset)->set, candidate);
+	ctx->candidate = candidate;
+
+	UNPROTECT(1);
+}
+
+
+// the search terms, in the order of the term IDs
+static SEXP items_search_context(SEXP sctx)
+{
+	return items_search(VECTOR_ELT(R_ExternalPtrProtected(sctx), 0));
+}
+
+
+static void search_context_dictionary(struct search_context *ctx,
+				      SEXP scategory, SEXP sweight)
+{
+	struct search_worker *wk;
+	int err = 0, ncat, w;
+
+	ncat = LENGTH(getAttrib(scategory, R_LevelsSymbol));
+	ctx->category = INTEGER(scategory);
+	ctx->weight = (sweight == R_NilValue) ? NULL : REAL(sweight);
+	ctx->ncategory = ncat;
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		TRY_ALLOC(wk->cat_count = corpus_calloc(ncat + 1,
+						sizeof(*wk->cat_count)));
+		TRY_ALLOC(wk->cat_score = corpus_calloc(ncat + 1,
+						sizeof(*wk->cat_score)));
+		TRY_ALLOC(wk->touched = corpus_malloc((ncat + 1)
+						* sizeof(*wk->touched)));
 	}
-        loc->nitem_max = size;
-	err = 0;
 out:
 	CHECK_ERROR(err);
 }
 
 
-SEXP text_count(SEXP sx, SEXP sterms)
+static void dictionary_add(struct search_worker *wk,
+			   const struct search_context *ctx, int term_id)
 {
-	SEXP ans, ssearch;
-	const struct utf8lite_text *text;
-	struct corpus_filter *filter;
-	struct corpus_search *search;
-	R_xlen_t i, n;
-	int count;
-	int err, nprot;
+	int cat = ctx->category[term_id] - 1;
 
-	nprot = 0;
+	if (wk->cat_count[cat] == 0) {
+		wk->touched[wk->ntouched++] = cat;
+	}
+	wk->cat_count[cat] += 1;
+	wk->cat_score[cat] += ctx->weight ? ctx->weight[term_id] : 1;
+}
 
-	PROTECT(sx = coerce_text(sx)); nprot++;
-	text = as_text(sx, &n);
-	filter = text_filter(sx);
 
-	PROTECT(ssearch = alloc_search(sterms, "count", filter)); nprot++;
-	search = as_search(ssearch);
+// move the current text's category totals to the entry list;
+// runs without the R API; safe to call from a worker thread
+static int dictionary_flush(struct search_worker *wk, int text_id)
+{
+	struct dict_entry *entries, *e;
+	size_t width = sizeof(*wk->entries);
+	int cat, err = 0, k, size;
+
+	if (wk->ntouched > wk->nentry_max - wk->nentry) {
+		size = wk->nentry_max;
+		TRY(corpus_array_size_add(&size, width, wk->nentry,
+					  wk->ntouched));
+		TRY_ALLOC(entries = corpus_realloc(wk->entries,
+						   size * width));
+		wk->entries = entries;
+		wk->nentry_max = size;
+	}
 
-	PROTECT(ans = allocVector(REALSXP, n)); nprot++;
-	setAttrib(ans, R_NamesSymbol, names_text(sx));
+	for (k = 0; k < wk->ntouched; k++) {
+		cat = wk->touched[k];
+		e = &wk->entries[wk->nentry++];
+		e->text_id = text_id;
+		e->category = cat;
+		e->count = wk->cat_count[cat];
+		e->score = wk->cat_score[cat];
+		wk->cat_count[cat] = 0;
+		wk->cat_score[cat] = 0;
+	}
+	wk->ntouched = 0;
+out:
+	return err;
+}
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
 
-		if (text[i].ptr == NULL) {
-			REAL(ans)[i] = NA_REAL;
+// record the spans of the text's tokens, skipping the ignored ones;
+// runs without the R API; safe to call from a worker thread
+static int worker_tokens(struct search_worker *wk,
+			 const struct utf8lite_text *text)
+{
+	struct corpus_filter *filter = wk->filter;
+	int *start, *end;
+	int err = 0, size;
+
+	wk->ntoken = 0;
+	TRY(corpus_filter_start(filter, text));
+
+	while (corpus_filter_advance(filter)) {
+		if (filter->type_id == CORPUS_TYPE_NONE) {
 			continue;
 		}
 
-		TRY(corpus_search_start(search, &text[i], filter));
+		if (wk->ntoken == wk->ntoken_max) {
+			size = wk->ntoken_max;
+			TRY(corpus_array_size_add(&size, sizeof(*start),
+						  wk->ntoken, 1));
+			TRY_ALLOC(start = corpus_realloc(wk->token_start,
+						size * sizeof(*start)));
+			wk->token_start = start;
+			TRY_ALLOC(end = corpus_realloc(wk->token_end,
+						size * sizeof(*end)));
+			wk->token_end = end;
+			wk->ntoken_max = size;
+		}
+
+		wk->token_start[wk->ntoken] =
+			(int)(filter->current.ptr - text->ptr);
+		wk->token_end[wk->ntoken] = wk->token_start[wk->ntoken]
+			+ (int)UTF8LITE_TEXT_SIZE(&filter->current);
+		wk->ntoken++;
+	}
+	TRY(filter->error);
+out:
+	return err;
+}
+
+
+// the number of tokens that start before the offset
+static int token_lower_bound(const int *start, int n, int off)
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (start[mid] < off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+// limit the contexts of the text's instances, items[first], ...,
+// items[last - 1], to the window of tokens on either side; the search
+// has finished with the filter, so the worker can use it for a second
+// pass over the text. Runs without the R API; safe to call from a
+// worker thread
+static int worker_windows(struct search_worker *wk,
+			  const struct search_context *ctx,
+			  const struct utf8lite_text *text, int first, int last)
+{
+	struct locate_item *item;
+	int begin, end, err = 0, k, ntok, size, t0, t1;
+
+	TRY(worker_tokens(wk, text));
+	ntok = wk->ntoken;
+	size = (int)UTF8LITE_TEXT_SIZE(text);
+
+	for (k = first; k < last; k++) {
+		item = &wk->loc.items[k];
+		begin = (int)(item->instance.ptr - text->ptr);
+		end = begin + (int)UTF8LITE_TEXT_SIZE(&item->instance);
+
+		// the instance spans tokens t0, ..., t1 - 1
+		t0 = token_lower_bound(wk->token_start, ntok, begin);
+		t1 = token_lower_bound(wk->token_start, ntok, end);
+
+		if (t0 - ctx->window > 0) {
+			item->before = begin
+				- wk->token_start[t0 - ctx->window];
+		} else {
+			item->before = begin;
+		}
+
+		if (ctx->window == 0) {
+			item->after = 0;
+		} else if (t1 + ctx->window < ntok) {
+			item->after = wk->token_end[t1 + ctx->window - 1]
+				- end;
+		} else {
+			item->after = size - end;
+		}
+	}
+out:
+	return err;
+}
+
+
+// keep a uniform random sample of the matches seen so far, replacing a
+// reservoir item with probability size / nseen (Algorithm R); calls
+// unif_rand, so it must run on the main thread
+static int sample_add(struct search_worker *wk,
+		      const struct search_context *ctx, int text_id,
+		      int term_id, const struct utf8lite_text *instance)
+{
+	struct locate_item *item;
+	double j;
+	int err = 0;
+
+	wk->nseen++;
 
+	if (ctx->size < 0 || wk->loc.nitem < ctx->size) {
+		TRY(locate_add(&wk->loc, text_id, term_id, instance));
+		goto out;
+	}
+
+	j = floor(wk->nseen * unif_rand());
+	if (j < ctx->size) {
+		item = &wk->loc.items[(int)j];
+		item->text_id = text_id;
+		item->term_id = term_id;
+		item->instance = *instance;
+	}
+out:
+	return err;
+}
+
+
+static int sample_item_cmp(const void *x1, const void *x2)
+{
+	const struct locate_item *item1 = x1;
+	const struct locate_item *item2 = x2;
+
+	if (item1->text_id != item2->text_id) {
+		return (item1->text_id < item2->text_id) ? -1 : 1;
+	}
+	if (item1->instance.ptr != item2->instance.ptr) {
+		return (item1->instance.ptr < item2->instance.ptr) ? -1 : 1;
+	}
+	return 0;
+}
+
+
+// set the windows for the sampled items, then put the items in random
+// order; calls unif_rand, so it must run on the main thread
+static void search_context_sample(struct search_context *ctx,
+				  const struct utf8lite_text *text)
+{
+	struct search_worker *wk = &ctx->worker[0];
+	struct locate_item *items = wk->loc.items;
+	struct locate_item item;
+	int err = 0, first, id, j, k, n = wk->loc.nitem;
+
+	if (ctx->window >= 0 && n > 0) {
+		// group the items by text so that each text gets one pass
+		qsort(items, n, sizeof(*items), sample_item_cmp);
+
+		first = 0;
+		while (first < n) {
+			RCORPUS_CHECK_INTERRUPT(first);
+
+			id = items[first].text_id;
+			k = first + 1;
+			while (k < n && items[k].text_id == id) {
+				k++;
+			}
+			TRY(worker_windows(wk, ctx, &text[id], first, k));
+			first = k;
+		}
+	}
+
+	// Fisher-Yates shuffle; the reservoir order is not uniform
+	for (k = n - 1; k > 0; k--) {
+		j = (int)floor((k + 1) * unif_rand());
+		item = items[k];
+		items[k] = items[j];
+		items[j] = item;
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+// runs without the R API; safe to call from a worker thread
+static int search_worker_text(struct search_worker *wk,
+			      const struct search_context *ctx,
+			      const struct utf8lite_text *text, R_xlen_t i)
+{
+	struct corpus_search *search = wk->search;
+	int count, err = 0, first;
+
+	if (text[i].ptr == NULL) {
+		if (ctx->kind == SEARCH_COUNT) {
+			ctx->count[i] = NA_REAL;
+		} else if (ctx->kind == SEARCH_DETECT) {
+			ctx->detect[i] = NA_LOGICAL;
+		}
+		goto out;
+	}
+
+	// the index has no matches for the text; no need to search
+	if (ctx->candidate && !ctx->candidate[i]) {
+		if (ctx->kind == SEARCH_COUNT) {
+			ctx->count[i] = 0;
+		} else if (ctx->kind == SEARCH_DETECT) {
+			ctx->detect[i] = FALSE;
+		}
+		goto out;
+	}
+
+	TRY(corpus_search_start(search, &text[i], wk->filter));
+
+	switch (ctx->kind) {
+	case SEARCH_COUNT:
 		count = 0;
 		while (corpus_search_advance(search)) {
 			count++;
 		}
-		REAL(ans)[i] = (double)count;
+		ctx->count[i] = (double)count;
+		break;
 
+	case SEARCH_DETECT:
+		if (corpus_search_advance(search)) {
+			ctx->detect[i] = TRUE;
+		} else {
+			ctx->detect[i] = FALSE;
+		}
+		break;
+
+	case SEARCH_SAMPLE:
+		while (corpus_search_advance(search)) {
+			TRY(sample_add(wk, ctx, (int)i,
+				       ctx->source[search->term_id],
+				       &search->current));
+		}
+		break;
+
+	case SEARCH_DICTIONARY:
+		while (corpus_search_advance(search)) {
+			dictionary_add(wk, ctx,
+				       ctx->source[search->term_id]);
+		}
 		TRY(search->error);
+		TRY(dictionary_flush(wk, (int)i));
+		break;
+
+	default:
+		first = wk->loc.nitem;
+		while (corpus_search_advance(search)) {
+			TRY(locate_add(&wk->loc, (int)i,
+				       ctx->source[search->term_id],
+				       &search->current));
+		}
+		TRY(search->error);
+
+		if (ctx->window >= 0 && wk->loc.nitem > first) {
+			TRY(worker_windows(wk, ctx, &text[i], first,
+					   wk->loc.nitem));
+		}
+		break;
+	}
+
+	TRY(search->error);
+out:
+	return err;
+}
+
+
+// runs without the R API; safe to call from a worker thread
+static int search_worker_run(struct search_worker *wk,
+			     const struct search_context *ctx,
+			     const struct utf8lite_text *text)
+{
+	R_xlen_t i;
+	int err = 0;
+
+	for (i = wk->begin; i < wk->end; i++) {
+		TRY(search_worker_text(wk, ctx, text, i));
+	}
+out:
+	return err;
+}
+
+
+static void search_context_run(struct search_context *ctx,
+			       const struct utf8lite_text *text)
+{
+	struct search_worker *wk;
+	R_xlen_t i;
+	int err = 0, w;
+
+	if (ctx->nworker == 1) {
+		wk = &ctx->worker[0];
+
+		for (i = wk->begin; i < wk->end; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			TRY(search_worker_text(wk, ctx, text, i));
+		}
+	} else {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(ctx->nworker) schedule(static, 1)
+#endif
+		for (w = 0; w < ctx->nworker; w++) {
+			ctx->worker[w].error = search_worker_run(
+						&ctx->worker[w], ctx, text);
+		}
+
+		for (w = 0; w < ctx->nworker; w++) {
+			TRY(ctx->worker[w].error);
+		}
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+// concatenate the workers' matches; the workers have contiguous blocks
+// of texts, so the matches stay in input order
+static void search_context_merge(const struct search_context *ctx,
+				 struct locate *loc)
+{
+	const struct locate *wloc;
+	int err = 0, nitem, w;
+
+	if (ctx->nworker == 1) {
+		*loc = ctx->worker[0].loc;
+		return;
+	}
+
+	nitem = 0;
+	for (w = 0; w < ctx->nworker; w++) {
+		wloc = &ctx->worker[w].loc;
+		TRY(wloc->nitem > INT_MAX - nitem ? CORPUS_ERROR_OVERFLOW : 0);
+		nitem += wloc->nitem;
 	}
 
-	err = 0;
+	loc->items = (void *)R_alloc(nitem, sizeof(*loc->items));
+	loc->nitem = 0;
+	loc->nitem_max = nitem;
+
+	for (w = 0; w < ctx->nworker; w++) {
+		wloc = &ctx->worker[w].loc;
+		if (wloc->nitem > 0) {
+			memcpy(loc->items + loc->nitem, wloc->items,
+			       wloc->nitem * sizeof(*loc->items));
+			loc->nitem += wloc->nitem;
+		}
+	}
 out:
 	CHECK_ERROR(err);
+}
+
+
+SEXP text_count(SEXP sx, SEXP sterms, SEXP smax_dist, SEXP sthreads,
+		SEXP sindex)
+{
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct search_context *ctx;
+	R_xlen_t n;
+	int max_dist, nprot = 0;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "count", SEARCH_COUNT,
+					    max_dist, sthreads)); nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "count", sindex);
+
+	PROTECT(ans = allocVector(REALSXP, n)); nprot++;
+	setAttrib(ans, R_NamesSymbol, names_text(sx));
+
+	ctx->count = REAL(ans);
+	search_context_run(ctx, text);
+
 	UNPROTECT(nprot);
 	return ans;
 }
 
 
-SEXP text_detect(SEXP sx, SEXP sterms)
+SEXP text_detect(SEXP sx, SEXP sterms, SEXP smax_dist, SEXP sthreads,
+		 SEXP sindex)
 {
-	SEXP ans, ssearch;
+	SEXP ans, sctx;
 	const struct utf8lite_text *text;
-	struct corpus_filter *filter;
-	struct corpus_search *search;
-	R_xlen_t i, n;
-	int err, nprot;
-
-	nprot = 0;
+	struct search_context *ctx;
+	R_xlen_t n;
+	int max_dist, nprot = 0;
 
 	PROTECT(sx = coerce_text(sx)); nprot++;
 	text = as_text(sx, &n);
-	filter = text_filter(sx);
 
-	PROTECT(ssearch = alloc_search(sterms, "detect", filter)); nprot++;
-	search = as_search(ssearch);
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "detect", SEARCH_DETECT,
+					    max_dist, sthreads)); nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "detect", sindex);
 
 	PROTECT(ans = allocVector(LGLSXP, n)); nprot++;
 	setAttrib(ans, R_NamesSymbol, names_text(sx));
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
+	ctx->detect = LOGICAL(ans);
+	search_context_run(ctx, text);
 
-		if (text[i].ptr == NULL) {
-			LOGICAL(ans)[i] = NA_LOGICAL;
-			continue;
-		}
+	UNPROTECT(nprot);
+	return ans;
+}
 
-		TRY(corpus_search_start(search, &text[i], filter));
 
-		if (corpus_search_advance(search)) {
-			LOGICAL(ans)[i] = TRUE;
-		} else {
-			LOGICAL(ans)[i] = FALSE;
-		}
+SEXP text_match(SEXP sx, SEXP sterms, SEXP smax_dist, SEXP sthreads,
+		SEXP sindex)
+{
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct search_context *ctx;
+	struct locate loc;
+	int max_dist, nprot = 0;
 
-		TRY(search->error);
-	}
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, NULL);
+
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "locate",
+					    SEARCH_LOCATE, max_dist,
+					    sthreads)); nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "locate", sindex);
+
+	search_context_run(ctx, text);
+	search_context_merge(ctx, &loc);
+
+	PROTECT(ans = make_matches(&loc, items_search_context(sctx))); nprot++;
 
-	err = 0;
-out:
-	CHECK_ERROR(err);
 	UNPROTECT(nprot);
 	return ans;
 }
 
 
-SEXP text_match(SEXP sx, SEXP sterms)
+SEXP text_locate(SEXP sx, SEXP sterms, SEXP smax_dist, SEXP swindow,
+		 SEXP sthreads, SEXP sindex)
 {
-	SEXP ans, sitems, ssearch;
-	const struct utf8lite_text *text, *token;
-	struct corpus_filter *filter;
-	struct corpus_search *search;
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct search_context *ctx;
 	struct locate loc;
-	R_xlen_t i, n;
-	int err, nprot, term_id;
-
-	nprot = 0;
+	int max_dist, nprot = 0;
 
 	PROTECT(sx = coerce_text(sx)); nprot++;
-	text = as_text(sx, &n);
-	filter = text_filter(sx);
+	text = as_text(sx, NULL);
+
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "locate",
+					    SEARCH_LOCATE, max_dist,
+					    sthreads)); nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "locate", sindex);
+	if (swindow != R_NilValue) {
+		ctx->window = INTEGER(swindow)[0];
+	}
 
-	PROTECT(ssearch = alloc_search(sterms, "locate", filter)); nprot++;
-	sitems = items_search(ssearch);
-	search = as_search(ssearch);
+	search_context_run(ctx, text);
+	search_context_merge(ctx, &loc);
 
-	locate_init(&loc);
+	PROTECT(ans = make_instances(&loc, sx, text)); nprot++;
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
+	UNPROTECT(nprot);
+	return ans;
+}
 
-		if (text[i].ptr == NULL) {
-			continue;
-		}
 
-		TRY(corpus_search_start(search, &text[i], filter));
+struct sample_args {
+	struct search_context *ctx;
+	const struct utf8lite_text *text;
+};
+
 
-		while (corpus_search_advance(search)) {
-			term_id = search->term_id;
-			token = &search->current;
-			locate_add(&loc, i, term_id, token);
-		}
+static SEXP sample_run(void *data)
+{
+	struct sample_args *args = data;
 
-		TRY(search->error);
+	search_context_run(args->ctx, args->text);
+	search_context_sample(args->ctx, args->text);
+	return R_NilValue;
+}
+
+
+static void sample_put_rng(void *data)
+{
+	(void)data;
+	PutRNGstate();
+}
+
+
+SEXP text_sample(SEXP sx, SEXP sterms, SEXP ssize, SEXP smax_dist,
+		 SEXP swindow, SEXP sthreads, SEXP sindex)
+{
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct search_context *ctx;
+	struct sample_args args;
+	struct locate loc;
+	int max_dist, nprot = 0;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, NULL);
+
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "sample",
+					    SEARCH_SAMPLE, max_dist,
+					    sthreads)); nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "sample", sindex);
+	if (ssize != R_NilValue) {
+		ctx->size = INTEGER(ssize)[0];
+	}
+	if (swindow != R_NilValue) {
+		ctx->window = INTEGER(swindow)[0];
 	}
 
-	PROTECT(ans = make_matches(&loc, sitems)); nprot++;
-	err = 0;
-out:
-	CHECK_ERROR(err);
+	// write the generator state back even if the search fails or gets
+	// interrupted, so that the draws it made stay consumed
+	args.ctx = ctx;
+	args.text = text;
+	GetRNGstate();
+	R_ExecWithCleanup(sample_run, &args, sample_put_rng, NULL);
+
+	search_context_merge(ctx, &loc);
+
+	PROTECT(ans = make_instances(&loc, sx, text)); nprot++;
+
 	UNPROTECT(nprot);
 	return ans;
 }
 
 
-SEXP text_locate(SEXP sx, SEXP sterms)
+// gather the workers' category totals into a compressed sparse column
+// matrix, with one row for each text and one column for each category
+static SEXP make_dictionary(const struct search_context *ctx)
 {
-	SEXP ans, ssearch;
-	const struct utf8lite_text *text, *token;
-	struct corpus_filter *filter;
-	struct corpus_search *search;
-	struct locate loc;
-	R_xlen_t i, n;
-	int err, nprot, term_id;
-
+	SEXP ans, names, sp, si, scount, sscore;
+	const struct search_worker *wk;
+	const struct dict_entry *e;
+	int *ptr, *next, *index;
+	double *count, *score;
+	int err = 0, j, k, ncat, nprot, nz, off, w;
+
+	ncat = ctx->ncategory;
 	nprot = 0;
 
-	PROTECT(sx = coerce_text(sx)); nprot++;
-	text = as_text(sx, &n);
-	filter = text_filter(sx);
+	PROTECT(sp = allocVector(INTSXP, ncat + 1)); nprot++;
+	ptr = INTEGER(sp);
+	memset(ptr, 0, (ncat + 1) * sizeof(*ptr));
 
-	PROTECT(ssearch = alloc_search(sterms, "locate", filter)); nprot++;
-	search = as_search(ssearch);
+	nz = 0;
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+		TRY(wk->nentry > INT_MAX - nz ? CORPUS_ERROR_OVERFLOW : 0);
+		nz += wk->nentry;
 
-	locate_init(&loc);
+		for (k = 0; k < wk->nentry; k++) {
+			ptr[wk->entries[k].category + 1]++;
+		}
+	}
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
+	for (j = 0; j < ncat; j++) {
+		ptr[j + 1] += ptr[j];
+	}
 
-		if (text[i].ptr == NULL) {
-			continue;
+	next = (void *)R_alloc(ncat + 1, sizeof(*next));
+	memcpy(next, ptr, (ncat + 1) * sizeof(*next));
+
+	PROTECT(si = allocVector(INTSXP, nz)); nprot++;
+	PROTECT(scount = allocVector(REALSXP, nz)); nprot++;
+	PROTECT(sscore = allocVector(REALSXP, nz)); nprot++;
+	index = INTEGER(si);
+	count = REAL(scount);
+	score = REAL(sscore);
+
+	// the workers have contiguous blocks of texts, so the rows in each
+	// column come out in increasing order
+	for (w = 0; w < ctx->nworker; w++) {
+		wk = &ctx->worker[w];
+
+		for (k = 0; k < wk->nentry; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+
+			e = &wk->entries[k];
+			off = next[e->category]++;
+			index[off] = e->text_id;
+			count[off] = e->count;
+			score[off] = e->score;
 		}
+	}
 
-		TRY(corpus_search_start(search, &text[i], filter));
+	PROTECT(ans = allocVector(VECSXP, 4)); nprot++;
+	SET_VECTOR_ELT(ans, 0, sp);
+	SET_VECTOR_ELT(ans, 1, si);
+	SET_VECTOR_ELT(ans, 2, scount);
+	SET_VECTOR_ELT(ans, 3, sscore);
 
-		while (corpus_search_advance(search)) {
-			term_id = search->term_id;
-			token = &search->current;
-			locate_add(&loc, i, term_id, token);
-		}
+	PROTECT(names = allocVector(STRSXP, 4)); nprot++;
+	SET_STRING_ELT(names, 0, mkChar("p"));
+	SET_STRING_ELT(names, 1, mkChar("i"));
+	SET_STRING_ELT(names, 2, mkChar("count"));
+	SET_STRING_ELT(names, 3, mkChar("score"));
+	setAttrib(ans, R_NamesSymbol, names);
+out:
+	CHECK_ERROR(err);
+	UNPROTECT(nprot);
+	return ans;
+}
 
-		TRY(search->error);
+
+SEXP text_dictionary(SEXP sx, SEXP sterms, SEXP scategory, SEXP sweight,
+		     SEXP smax_dist, SEXP sthreads, SEXP sindex)
+{
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct search_context *ctx;
+	R_xlen_t n;
+	int max_dist, nprot = 0;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+
+	if (n > INT_MAX) {
+		Rf_error("number of texts (%"PRIu64") exceeds maximum (%d)",
+			 (uint64_t)n, INT_MAX);
 	}
 
-	PROTECT(ans = make_instances(&loc, sx, text)); nprot++;
-	err = 0;
-out:
+	max_dist = as_max_dist(smax_dist);
+	PROTECT(sctx = alloc_search_context(sx, sterms, "dictionary",
+					    SEARCH_DICTIONARY, max_dist,
+					    sthreads));
+	nprot++;
+	ctx = as_context(sctx);
+	search_context_index(sctx, sx, sterms, "dictionary", sindex);
+
+	search_context_dictionary(ctx, scategory, sweight);
+	search_context_run(ctx, text);
+
+	PROTECT(ans = make_dictionary(ctx)); nprot++;
+
 	UNPROTECT(nprot);
-	CHECK_ERROR(err);
 	return ans;
 }
 
@@ -392,9 +1135,15 @@ SEXP make_instances(struct locate *loc, SEXP sx,
 		off = (int)(loc->items[i].instance.ptr - text[text_id].ptr);
 		len = (int)UTF8LITE_TEXT_SIZE(&loc->items[i].instance);
 
+		// limit the contexts to the windows, if the search set them
+		if (loc->items[i].after >= 0) {
+			stop = start + off + len + loc->items[i].after - 1;
+		}
+
 		INTEGER(bsource)[i] = source;
 		REAL(brow)[i] = row;
-		INTEGER(bstart)[i] = start;
+		INTEGER(bstart)[i] = (loc->items[i].before >= 0)
+			? start + off - loc->items[i].before : start;
 		INTEGER(bstop)[i] = start + off - 1;
 
 		INTEGER(isource)[i] = source;
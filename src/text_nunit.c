@@ -75,18 +75,18 @@ out:
 SEXP text_ntoken(SEXP sx)
 {
 	SEXP ans, names;
-	struct corpus_filter *filter;
+	const struct token_cache *tokens;
 	const struct utf8lite_text *text;
 	double *count;
-	R_xlen_t i, n, nunit;
-	int nprot, err = 0;
+	R_xlen_t i, n, t, nunit;
+	int nprot;
 
 	nprot = 0;
 
 	PROTECT(sx = coerce_text(sx)); nprot++;
 	text = as_text(sx, &n);
 	names = names_text(sx);
-	filter = text_filter(sx);
+	tokens = text_token_cache(sx);
 
 	PROTECT(ans = allocVector(REALSXP, n)); nprot++;
 	setAttrib(ans, R_NamesSymbol, names);
@@ -100,23 +100,18 @@ SEXP text_ntoken(SEXP sx)
 			continue;
 		}
 
-		TRY(corpus_filter_start(filter, &text[i]));
-
 		nunit = 0;
 
-		while (corpus_filter_advance(filter)) {
-			if (filter->type_id < 0) {
+		for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+			if (tokens->type_id[t] < 0) {
 				continue;
 			}
 			nunit++;
 		}
-		TRY(filter->error);
 
 		count[i] = (double)nunit;
 	}
 
-out:
 	UNPROTECT(nprot);
-	CHECK_ERROR(err);
 	return ans;
 }
@@ -115,10 +115,10 @@ static SEXP context_make(struct context *ctx, SEXP sx)
 	SEXP ans, handle, sources, psource, prow, pstart, ptable, source,
 	     row, start, stop, index, sparent, stext, names, filter,
 	     sclass, row_names;
-	struct rcorpus_text *obj;
+	struct utf8lite_text *block;
 	R_xlen_t src, i, iblock, nblock;
 	double r;
-	int err = 0, j, off, len, nprot;
+	int j, off, len, nprot;
 
 	context_trim(ctx);
 
@@ -177,12 +177,9 @@ static SEXP context_make(struct context *ctx, SEXP sx)
 	nprot++;
 
 	handle = getListElement(stext, "handle");
-	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
-	R_SetExternalPtrAddr(handle, obj);
-
-	obj->text = ctx->block;
-	obj->length = nblock;
+	block = ctx->block;
 	ctx->block = NULL;
+	text_spans_adopt(handle, block, nblock);
 
 	PROTECT(ans = allocVector(VECSXP, 3)); nprot++;
 	SET_VECTOR_ELT(ans, 0, sparent);
@@ -205,8 +202,6 @@ static SEXP context_make(struct context *ctx, SEXP sx)
         SET_STRING_ELT(sclass, 1, mkChar("data.frame"));
         setAttrib(ans, R_ClassSymbol, sclass);
 
-out:
-	CHECK_ERROR(err);
 	UNPROTECT(nprot);
 	return ans;
 }
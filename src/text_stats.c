@@ -0,0 +1,246 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "corpus/src/table.h"
+#include "corpus/src/intset.h"
+#include "rcorpus.h"
+
+
+// the per-text statistics, in column order; to add one, give it a slot
+// here and a name in stat_names, then compute it in stats_text
+enum text_stat {
+	STAT_TOKENS = 0,
+	STAT_TYPES,
+	STAT_SENTENCES,
+	STAT_BYTES,
+	STAT_CHARS,
+	STAT_DROPPED,
+	STAT_COUNT
+};
+
+static const char *stat_names[STAT_COUNT] = {
+	"tokens",
+	"types",
+	"sentences",
+	"bytes",
+	"chars",
+	"dropped"
+};
+
+
+struct stats_context {
+	struct corpus_intset types; // current text's types, reused
+	const struct token_cache *tokens; // or NULL to scan with the filter
+	struct corpus_filter *filter;
+	struct corpus_sentfilter *sentfilter;
+	int has_types;
+};
+
+
+static void stats_context_destroy(void *obj)
+{
+	struct stats_context *ctx = obj;
+
+	if (ctx->has_types) {
+		corpus_intset_destroy(&ctx->types);
+		ctx->has_types = 0;
+	}
+}
+
+
+static int stats_add_token(struct stats_context *ctx, int type_id,
+			   double *stat)
+{
+	int err = 0;
+
+	if (type_id < 0) {
+		stat[STAT_DROPPED]++;
+		goto out;
+	}
+
+	stat[STAT_TOKENS]++;
+	TRY(corpus_intset_add(&ctx->types, type_id, NULL));
+out:
+	return err;
+}
+
+
+// count the tokens, types, and dropped tokens; use the text's token
+// cache if it has one, otherwise scan without building the cache
+static int stats_words(struct stats_context *ctx,
+		       const struct utf8lite_text *text, R_xlen_t i,
+		       double *stat)
+{
+	const struct token_cache *tokens = ctx->tokens;
+	struct corpus_filter *filter = ctx->filter;
+	R_xlen_t t;
+	int err = 0;
+
+	corpus_intset_clear(&ctx->types);
+
+	if (tokens) {
+		for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+			TRY(stats_add_token(ctx, tokens->type_id[t], stat));
+		}
+	} else {
+		TRY(corpus_filter_start(filter, text));
+
+		while (corpus_filter_advance(filter)) {
+			if (filter->type_id == CORPUS_TYPE_NONE) {
+				continue;
+			}
+			TRY(stats_add_token(ctx, filter->type_id, stat));
+		}
+		TRY(filter->error);
+	}
+
+	stat[STAT_TYPES] = (double)ctx->types.nitem;
+out:
+	return err;
+}
+
+
+static int stats_sentences(struct stats_context *ctx,
+			   const struct utf8lite_text *text, double *stat)
+{
+	struct corpus_sentfilter *filter = ctx->sentfilter;
+	int err = 0;
+
+	if (UTF8LITE_TEXT_SIZE(text) == 0) { // empty text
+		goto out;
+	}
+
+	TRY(corpus_sentfilter_start(filter, text));
+
+	while (corpus_sentfilter_advance(filter)) {
+		stat[STAT_SENTENCES]++;
+	}
+	TRY(filter->error);
+out:
+	return err;
+}
+
+
+// count the characters and the bytes of the decoded UTF-8
+static void stats_chars(const struct utf8lite_text *text, double *stat)
+{
+	struct utf8lite_text_iter it;
+	uint8_t buf[4], *dst;
+	const uint8_t *ptr, *end;
+	size_t size = UTF8LITE_TEXT_SIZE(text);
+
+	if (!UTF8LITE_TEXT_HAS_ESC(text)) {
+		ptr = text->ptr;
+		end = ptr + size;
+		while (ptr != end) {
+			if ((*ptr & 0xC0) != 0x80) { // not a continuation byte
+				stat[STAT_CHARS]++;
+			}
+			ptr++;
+		}
+		stat[STAT_BYTES] = (double)size;
+		return;
+	}
+
+	utf8lite_text_iter_make(&it, text);
+	while (utf8lite_text_iter_advance(&it)) {
+		dst = buf;
+		utf8lite_encode_utf8(it.current, &dst);
+		stat[STAT_CHARS]++;
+		stat[STAT_BYTES] += (double)(dst - buf);
+	}
+}
+
+
+static int stats_text(struct stats_context *ctx,
+		      const struct utf8lite_text *text, R_xlen_t i,
+		      double *stat)
+{
+	int err = 0, k;
+
+	if (!text[i].ptr) { // missing text
+		for (k = 0; k < STAT_COUNT; k++) {
+			stat[k] = NA_REAL;
+		}
+		goto out;
+	}
+
+	for (k = 0; k < STAT_COUNT; k++) {
+		stat[k] = 0;
+	}
+
+	// make all of the passes while the text is still in cache
+	TRY(stats_words(ctx, &text[i], i, stat));
+	TRY(stats_sentences(ctx, &text[i], stat));
+	stats_chars(&text[i], stat);
+out:
+	return err;
+}
+
+
+SEXP text_stats(SEXP sx)
+{
+	SEXP ans, names, sctx;
+	struct stats_context *ctx;
+	const struct utf8lite_text *text;
+	double *column[STAT_COUNT];
+	double stat[STAT_COUNT];
+	R_xlen_t i, n;
+	int err = 0, k, nprot = 0;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), stats_context_destroy));
+	nprot++;
+	ctx = as_context(sctx);
+
+	TRY(corpus_intset_init(&ctx->types));
+	ctx->has_types = 1;
+
+	ctx->filter = text_filter(sx);
+	ctx->sentfilter = text_sentfilter(sx);
+	if (text_has_token_cache(sx)) {
+		ctx->tokens = text_token_cache(sx);
+	}
+
+	PROTECT(ans = allocVector(VECSXP, STAT_COUNT)); nprot++;
+	PROTECT(names = allocVector(STRSXP, STAT_COUNT)); nprot++;
+	for (k = 0; k < STAT_COUNT; k++) {
+		SET_VECTOR_ELT(ans, k, allocVector(REALSXP, n));
+		SET_STRING_ELT(names, k, mkChar(stat_names[k]));
+		column[k] = REAL(VECTOR_ELT(ans, k));
+	}
+	setAttrib(ans, R_NamesSymbol, names);
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		TRY(stats_text(ctx, text, i, stat));
+		for (k = 0; k < STAT_COUNT; k++) {
+			column[k][i] = stat[k];
+		}
+	}
+
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return ans;
+}
@@ -17,37 +17,17 @@
 #include "rcorpus.h"
 
 
-static int text_len(const struct utf8lite_text *text,
-		    struct corpus_filter *filter)
-{
-	int err = 0, len = 0;
-
-	TRY(corpus_filter_start(filter, text));
-	while (corpus_filter_advance(filter)) {
-		if (filter->type_id == CORPUS_TYPE_NONE) {
-			continue;
-		}
-		len++;
-	}
-	TRY(filter->error);
-out:
-	CHECK_ERROR(err);
-	return len;
-}
-
-
 SEXP text_sub(SEXP sx, SEXP sstart, SEXP send)
 {
 	SEXP ans, sources, table, tsource, trow, tstart, tstop, names, sfilter;
 	const struct utf8lite_text *text;
-	const uint8_t *base, *ptr;
-	struct corpus_filter *filter;
+	const struct token_cache *tokens;
 	const int *start, *end;
-	R_xlen_t i, n, nstart, nend;
-	int err = 0, nprot = 0, s, e, j, m;
+	R_xlen_t i, n, nstart, nend, off;
+	int nprot = 0, s, e, m;
 
 	text = as_text(sx, &n);
-	filter = text_filter(sx);
+	tokens = text_token_cache(sx);
 	sources = getListElement(sx, "sources");
 	table = getListElement(sx, "table");
 	tsource = getListElement(table, "source");
@@ -81,21 +61,20 @@ SEXP text_sub(SEXP sx, SEXP sstart, SEXP send)
 
 		// convert negative indices to non-negative,
 		// except for end = -1
-		if (s < 0 || e < -1) {
-			m = text_len(&text[i], filter);
+		off = tokens->offset[i];
+		m = (int)(tokens->offset[i + 1] - off);
 
+		if (s < 0) {
+			s = s + m + 1;
 			if (s < 0) {
-				s = s + m + 1;
-				if (s < 0) {
-					s = 0;
-				}
+				s = 0;
 			}
+		}
 
-			if (e < -1) {
-				e = e + m + 1;
-				if (e < 0) {
-					e = 0;
-				}
+		if (e < -1) {
+			e = e + m + 1;
+			if (e < 0) {
+				e = 0;
 			}
 		}
 
@@ -104,61 +83,35 @@ SEXP text_sub(SEXP sx, SEXP sstart, SEXP send)
 			s = 1;
 		}
 
-		base = text[i].ptr - (INTEGER(tstart)[i] - 1);
-
-		// find start
-		j = 0;
-		TRY(corpus_filter_start(filter, &text[i]));
-		while (j != s && corpus_filter_advance(filter)) {
-			if (filter->type_id == CORPUS_TYPE_NONE) {
-				// skip ignored
-				continue;
-			}
-			j++;
-		}
-		TRY(filter->error);
-
 		// handle case when start is after end of text
-		if (j < s) {
+		if (s > m) {
 			INTEGER(tstart)[i] = INTEGER(tstop)[i] + 1;
 			continue;
 		}
 
 		// set subsequence start
-		ptr = filter->current.ptr;
-		INTEGER(tstart)[i] = (int)(ptr - base) + 1;
+		INTEGER(tstart)[i] += tokens->start[off + s - 1];
 
-		// handle case when end is the last token
-		if (e == -1) {
+		// handle case when end is the last token, or after
+		if (e == -1 || e >= m) {
 			continue;
 		}
 
-		// find end
-		while (j != e + 1 && corpus_filter_advance(filter)) {
-			if (filter->type_id == CORPUS_TYPE_NONE) {
-				// skip ignored
-				continue;
-			}
-			j++;
-		}
-		TRY(filter->error);
-
-		// handle case when end is after end of text
-		if (j < e + 1) {
+		// handle case when end is before start
+		if (e < s) {
+			INTEGER(tstop)[i] = INTEGER(tstart)[i] - 1;
 			continue;
 		}
 
-		// set subsequence end
-		ptr = filter->current.ptr;
-		INTEGER(tstop)[i] = (int)(ptr - base);
+		// set subsequence end, just before token e + 1
+		INTEGER(tstop)[i] = INTEGER(tstart)[i] - 1
+			+ (tokens->start[off + e] - tokens->start[off + s - 1]);
 	}
 
 	PROTECT(ans = alloc_text(sources, tsource, trow, tstart, tstop,
 				 names, sfilter));
 	nprot++;
 
-out:
 	UNPROTECT(nprot);
-	CHECK_ERROR(err);
 	return ans;
 }
@@ -0,0 +1,974 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rcorpus.h"
+
+#define SUBSTRING_INDEX_TAG install("corpus::text_substring_index")
+
+// number of bits between rank checkpoints in the wavelet matrix levels
+#define RANK_BLOCK 512
+
+// sample the suffix array at every SA_SAMPLE-th text position
+#define SA_SAMPLE 32
+
+/*
+ * An FM-index over the decoded bytes of the texts, each followed by a
+ * 0 byte. R strings cannot contain 0, so a pattern never matches
+ * across texts. The index keeps the Burrows-Wheeler transform (BWT) of
+ * the data in a wavelet matrix, which supports both reading a BWT byte
+ * and ranking a byte within a BWT prefix in eight bit-vector rank steps,
+ * along with a sample of the suffix array. Counting a pattern's
+ * occurrences takes one backward search step per pattern byte; locating
+ * each one walks back at most SA_SAMPLE - 1 steps to a sampled position.
+ * The first position of each text is always sampled, so a walk never
+ * crosses into the previous text.
+ *
+ * Level l of the wavelet matrix holds bit 7 - l of each BWT byte, with
+ * the bytes reordered by their higher bits (stably, zeros first). Each
+ * level has a 32-bit rank checkpoint every RANK_BLOCK bits, so the BWT
+ * takes about 1.06 bytes per text byte, and the suffix array sample
+ * adds about 0.3 more.
+ */
+
+struct substring_index {
+	uint64_t *bits;		// the 8 levels of the wavelet matrix, each
+				// with nword words
+	uint32_t *rank;		// number of 1 bits in each level before
+				// each RANK_BLOCK boundary
+	uint64_t *sampled;	// bit set for the rows with sampled suffixes
+	int *sampled_rank;	// number of sampled rows before each word
+	int *sample;		// sampled suffix positions, in row order
+	int *start;		// text i starts at position start[i]
+	int *raw;		// for each text with escapes, the offset in
+				// the raw text of each position and its end
+	int *raw_start;		// text i's raw offsets start at
+				// raw[raw_start[i]], or -1 if it has no
+				// escapes; NULL if no texts have escapes
+	int first[257];		// number of suffixes that start with a
+				// byte less than c
+	int zeros[8];		// number of 0 bits in each level
+	int nword;		// words in each level
+	int nblock;		// rank checkpoints in each level
+	int size;
+	int ntext;
+};
+
+// an occurrence of a pattern
+struct substring_match {
+	int text_id;
+	int start;
+	int pattern;
+};
+
+
+static void substring_index_free(struct substring_index *obj)
+{
+	if (!obj) {
+		return;
+	}
+
+	corpus_free(obj->raw_start);
+	corpus_free(obj->raw);
+	corpus_free(obj->start);
+	corpus_free(obj->sample);
+	corpus_free(obj->sampled_rank);
+	corpus_free(obj->sampled);
+	corpus_free(obj->rank);
+	corpus_free(obj->bits);
+	corpus_free(obj);
+}
+
+
+static void free_substring_index(SEXP sindex)
+{
+	struct substring_index *obj = R_ExternalPtrAddr(sindex);
+	substring_index_free(obj);
+	R_ClearExternalPtr(sindex);
+}
+
+
+static struct substring_index *as_substring_index(SEXP sindex)
+{
+	struct substring_index *obj;
+
+	if (!((TYPEOF(sindex) == EXTPTRSXP)
+			&& (R_ExternalPtrTag(sindex) == SUBSTRING_INDEX_TAG))) {
+		Rf_error("invalid 'text_substring_index' object");
+	}
+
+	obj = R_ExternalPtrAddr(sindex);
+	if (!obj) {
+		Rf_error("text substring index has been freed");
+	}
+
+	return obj;
+}
+
+
+/*
+ * Sort the suffixes of data[0], ..., data[n - 1] by prefix doubling:
+ * after the round for step k, the suffixes are in order by their first
+ * 2k bytes, and rank[i] is the position of the first suffix that
+ * shares the first 2k bytes of suffix i. Each round is a counting sort
+ * by the rank of suffix i + k (already in order from the previous
+ * round), then a stable counting sort by the rank of suffix i.
+ *
+ * Runs without the R API.
+ */
+static int suffix_sort(const uint8_t *data, int n, int *sa)
+{
+	int *rank, *tmp, *count;
+	int c, err = 0, i, j, k, ncount, r;
+
+	rank = NULL;
+	tmp = NULL;
+	count = NULL;
+
+	if (n == 0) {
+		goto out;
+	}
+
+	ncount = (n > 256) ? n : 256;
+	TRY_ALLOC(rank = corpus_malloc(n * sizeof(*rank)));
+	TRY_ALLOC(tmp = corpus_malloc(n * sizeof(*tmp)));
+	TRY_ALLOC(count = corpus_malloc((ncount + 1) * sizeof(*count)));
+
+	// sort by the first byte
+	memset(count, 0, (ncount + 1) * sizeof(*count));
+	for (i = 0; i < n; i++) {
+		count[data[i] + 1]++;
+	}
+	for (c = 0; c < 256; c++) {
+		count[c + 1] += count[c];
+	}
+	for (i = 0; i < n; i++) {
+		sa[count[data[i]]++] = i;
+	}
+	for (j = 0; j < n; j++) {
+		i = sa[j];
+		rank[i] = (j > 0 && data[sa[j - 1]] == data[i])
+			? rank[sa[j - 1]] : j;
+	}
+
+	for (k = 1; k < n; k *= 2) {
+		// order by the second key: the suffixes without one come
+		// first, then the rest in the order of suffix i + k
+		r = 0;
+		for (i = n - k; i < n; i++) {
+			tmp[r++] = i;
+		}
+		for (j = 0; j < n; j++) {
+			if (sa[j] >= k) {
+				tmp[r++] = sa[j] - k;
+			}
+		}
+
+		// stable sort by the first key; the ranks are the start
+		// positions of the groups, so they index the output
+		memset(count, 0, (ncount + 1) * sizeof(*count));
+		for (j = 0; j < n; j++) {
+			count[rank[tmp[j]]]++;
+		}
+		for (j = 0, r = 0; j < n; j++) {
+			c = count[j];
+			count[j] = r;
+			r += c;
+		}
+		for (j = 0; j < n; j++) {
+			i = tmp[j];
+			sa[count[rank[i]]++] = i;
+		}
+
+		// re-rank by both keys
+		tmp[sa[0]] = 0;
+		for (j = 1; j < n; j++) {
+			i = sa[j];
+			r = sa[j - 1];
+			if (rank[i] == rank[r]
+				&& ((i + k < n) ? rank[i + k] : -1)
+				    == ((r + k < n) ? rank[r + k] : -1)) {
+				tmp[i] = tmp[r];
+			} else {
+				tmp[i] = j;
+			}
+		}
+		memcpy(rank, tmp, n * sizeof(*rank));
+
+		// stop once every suffix has its own rank
+		if (rank[sa[n - 1]] == n - 1) {
+			for (j = 1; j < n; j++) {
+				if (rank[sa[j]] == rank[sa[j - 1]]) {
+					break;
+				}
+			}
+			if (j == n) {
+				break;
+			}
+		}
+	}
+
+out:
+	corpus_free(count);
+	corpus_free(tmp);
+	corpus_free(rank);
+	return err;
+}
+
+
+static int popcount64(uint64_t x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555);
+	x = (x & 0x3333333333333333) + ((x >> 2) & 0x3333333333333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0F;
+	return (int)((x * 0x0101010101010101) >> 56);
+}
+
+
+// the number of 1 bits before bit i in the level
+static int level_rank1(const struct substring_index *obj, int l, int i)
+{
+	const uint64_t *bits = obj->bits + (size_t)l * obj->nword;
+	int b = i / RANK_BLOCK, w, r;
+
+	r = (int)obj->rank[(size_t)l * obj->nblock + b];
+	for (w = b * (RANK_BLOCK / 64); w < i / 64; w++) {
+		r += popcount64(bits[w]);
+	}
+	if (i % 64) {
+		r += popcount64(bits[i / 64]
+				& ((((uint64_t)1) << (i % 64)) - 1));
+	}
+
+	return r;
+}
+
+
+// move a position in level l to the next level, following the bit
+static int level_map(const struct substring_index *obj, int l, int i,
+		     int bit)
+{
+	int r = level_rank1(obj, l, i);
+	return bit ? obj->zeros[l] + r : i - r;
+}
+
+
+// the number of times that byte c appears in bwt[0], ..., bwt[i - 1]
+static int substring_rank(const struct substring_index *obj, int c, int i)
+{
+	int bit, l, p = 0;
+
+	// p follows the start of the block of c's at each level
+	for (l = 0; l < 8; l++) {
+		bit = (c >> (7 - l)) & 1;
+		p = level_map(obj, l, p, bit);
+		i = level_map(obj, l, i, bit);
+	}
+
+	return i - p;
+}
+
+
+// the row of the suffix one position back from the suffix in row i
+// (the LF mapping), and the byte at that position, bwt[i]
+static int substring_prev(const struct substring_index *obj, int i,
+			  int *cptr)
+{
+	const uint64_t *bits;
+	int bit, c = 0, l, p = 0;
+
+	for (l = 0; l < 8; l++) {
+		bits = obj->bits + (size_t)l * obj->nword;
+		bit = (int)((bits[i / 64] >> (i % 64)) & 1);
+		c = (c << 1) | bit;
+		p = level_map(obj, l, p, bit);
+		i = level_map(obj, l, i, bit);
+	}
+
+	*cptr = c;
+	return obj->first[c] + i - p;
+}
+
+
+// build the wavelet matrix levels from the BWT; reorders the BWT, using
+// 'tmp' for scratch. Runs without the R API.
+static int substring_wavelet(struct substring_index *obj, uint8_t *bwt,
+			     uint8_t *tmp)
+{
+	uint64_t *bits;
+	uint32_t *rank;
+	uint8_t *swap;
+	int b, err = 0, j, l, n = obj->size, nzero, o, w, z;
+
+	obj->nword = n / 64 + 1;
+	obj->nblock = n / RANK_BLOCK + 1;
+	TRY_ALLOC(obj->bits = corpus_calloc((size_t)8 * obj->nword,
+					    sizeof(*obj->bits)));
+	TRY_ALLOC(obj->rank = corpus_malloc((size_t)8 * obj->nblock
+					    * sizeof(*obj->rank)));
+
+	for (l = 0; l < 8; l++) {
+		bits = obj->bits + (size_t)l * obj->nword;
+		rank = obj->rank + (size_t)l * obj->nblock;
+
+		nzero = 0;
+		for (j = 0; j < n; j++) {
+			if ((bwt[j] >> (7 - l)) & 1) {
+				bits[j / 64] |= ((uint64_t)1) << (j % 64);
+			} else {
+				nzero++;
+			}
+		}
+		obj->zeros[l] = nzero;
+
+		// stable partition for the next level, zeros first
+		z = 0;
+		o = nzero;
+		for (j = 0; j < n; j++) {
+			if ((bwt[j] >> (7 - l)) & 1) {
+				tmp[o++] = bwt[j];
+			} else {
+				tmp[z++] = bwt[j];
+			}
+		}
+		swap = bwt;
+		bwt = tmp;
+		tmp = swap;
+
+		// the rank checkpoints
+		w = 0;
+		rank[0] = 0;
+		for (b = 1; b < obj->nblock; b++) {
+			rank[b] = rank[b - 1];
+			for (; w < b * (RANK_BLOCK / 64); w++) {
+				rank[b] += (uint32_t)popcount64(bits[w]);
+			}
+		}
+	}
+out:
+	return err;
+}
+
+
+static int substring_is_sampled(const struct substring_index *obj, int i)
+{
+	return (obj->sampled[i / 64] >> (i % 64)) & 1;
+}
+
+
+// the text position of the suffix in row i
+static int substring_position(const struct substring_index *obj, int i)
+{
+	uint64_t word;
+	int c, k, steps = 0;
+
+	while (!substring_is_sampled(obj, i)) {
+		i = substring_prev(obj, i, &c);
+		steps++;
+	}
+
+	word = obj->sampled[i / 64] & ((((uint64_t)1) << (i % 64)) - 1);
+	k = obj->sampled_rank[i / 64];
+	while (word) {
+		word &= word - 1;
+		k++;
+	}
+
+	return obj->sample[k] + steps;
+}
+
+
+// find the rows of the suffixes that start with the pattern; one step
+// for each pattern byte, from last to first
+static void substring_range(const struct substring_index *obj,
+			    const struct utf8lite_text *pattern,
+			    int *loptr, int *hiptr)
+{
+	const uint8_t *ptr = pattern->ptr + UTF8LITE_TEXT_SIZE(pattern);
+	int c, lo = 0, hi = obj->size;
+
+	while (ptr != pattern->ptr && lo < hi) {
+		c = *--ptr;
+		lo = obj->first[c] + substring_rank(obj, c, lo);
+		hi = obj->first[c] + substring_rank(obj, c, hi);
+	}
+
+	*loptr = lo;
+	*hiptr = (lo < hi) ? hi : lo;
+}
+
+
+// the text containing the position
+static int substring_text_id(const struct substring_index *obj, int pos)
+{
+	int lo = 0, hi = obj->ntext, mid;
+
+	// find the last text that starts at or before pos
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (obj->start[mid] <= pos) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+// the decoded size of a text; escapes decode to fewer bytes
+static size_t decoded_size(const struct utf8lite_text *text)
+{
+	struct utf8lite_text_iter it;
+	uint8_t buf[4], *ptr;
+	size_t size;
+
+	if (!UTF8LITE_TEXT_HAS_ESC(text)) {
+		return UTF8LITE_TEXT_SIZE(text);
+	}
+
+	size = 0;
+	utf8lite_text_iter_make(&it, text);
+	while (utf8lite_text_iter_advance(&it)) {
+		ptr = buf;
+		utf8lite_encode_utf8(it.current, &ptr);
+		size += (size_t)(ptr - buf);
+	}
+
+	return size;
+}
+
+
+// scratch space for building an index, freed on error or interrupt
+struct substring_build {
+	uint8_t *data;
+	uint8_t *bwt;
+	int *sa;
+};
+
+
+static void substring_build_destroy(void *obj)
+{
+	struct substring_build *b = obj;
+
+	corpus_free(b->sa);
+	b->sa = NULL;
+	corpus_free(b->bwt);
+	b->bwt = NULL;
+	corpus_free(b->data);
+	b->data = NULL;
+}
+
+
+SEXP text_substring_index(SEXP sx)
+{
+	SEXP ans, sctx;
+	const struct utf8lite_text *text;
+	struct substring_index *obj;
+	struct substring_build *b;
+	struct utf8lite_text_iter it;
+	const uint8_t *raw;
+	uint8_t *data, *ptr, *end;
+	int *sa, *map;
+	size_t size;
+	R_xlen_t i, ntext;
+	int c, err = 0, j, k, n, nprot = 0, nraw, nsample, nword, pos;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &ntext);
+
+	if (ntext > INT_MAX) {
+		Rf_error("number of texts (%"PRIu64") exceeds maximum (%d)",
+			 (uint64_t)ntext, INT_MAX);
+	}
+
+	PROTECT(ans = R_MakeExternalPtr(NULL, SUBSTRING_INDEX_TAG,
+					R_NilValue)); nprot++;
+	R_RegisterCFinalizerEx(ans, free_substring_index, TRUE);
+
+	PROTECT(sctx = alloc_context(sizeof(*b), substring_build_destroy));
+	nprot++;
+	b = as_context(sctx);
+
+	TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+	R_SetExternalPtrAddr(ans, obj);
+	obj->ntext = (int)ntext;
+
+	// lay out the texts, each followed by a 0
+	TRY_ALLOC(obj->start = corpus_malloc((ntext + 1)
+					     * sizeof(*obj->start)));
+	size = 0;
+	nraw = 0;
+	for (i = 0; i < ntext; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		obj->start[i] = (int)size;
+		if (text[i].ptr) {
+			size += decoded_size(&text[i]);
+			if (UTF8LITE_TEXT_HAS_ESC(&text[i])) {
+				nraw += (int)size - obj->start[i] + 1;
+			}
+		}
+		size++;
+
+		if (size > INT_MAX) {
+			Rf_error("total text size exceeds maximum (%d)",
+				 INT_MAX);
+		}
+	}
+	obj->start[ntext] = (int)size;
+	n = (int)size;
+	obj->size = n;
+
+	TRY_ALLOC(data = b->data = corpus_malloc(n + 1));
+
+	// only the texts with escapes need raw offsets
+	if (nraw > 0) {
+		TRY_ALLOC(obj->raw = corpus_malloc(nraw * sizeof(*obj->raw)));
+		TRY_ALLOC(obj->raw_start = corpus_malloc(
+					ntext * sizeof(*obj->raw_start)));
+	}
+
+	nraw = 0;
+	for (i = 0; i < ntext; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		ptr = data + obj->start[i];
+		if (text[i].ptr && UTF8LITE_TEXT_HAS_ESC(&text[i])) {
+			obj->raw_start[i] = nraw;
+			map = obj->raw + nraw;
+			utf8lite_text_iter_make(&it, &text[i]);
+			raw = text[i].ptr;
+			while (utf8lite_text_iter_advance(&it)) {
+				end = ptr;
+				utf8lite_encode_utf8(it.current, &end);
+				while (ptr != end) {
+					*map++ = (int)(raw - text[i].ptr);
+					ptr++;
+				}
+				raw = it.ptr;
+			}
+			*map++ = (int)UTF8LITE_TEXT_SIZE(&text[i]);
+			nraw = (int)(map - obj->raw);
+		} else {
+			if (obj->raw_start) {
+				obj->raw_start[i] = -1;
+			}
+			if (text[i].ptr) {
+				size = UTF8LITE_TEXT_SIZE(&text[i]);
+				memcpy(ptr, text[i].ptr, size);
+				ptr += size;
+			}
+		}
+
+		*ptr = 0;
+	}
+
+	TRY_ALLOC(sa = b->sa = corpus_malloc((n + 1) * sizeof(*sa)));
+	TRY(suffix_sort(data, n, sa));
+
+	// the BWT and the byte counts
+	TRY_ALLOC(b->bwt = corpus_malloc(n + 1));
+	memset(obj->first, 0, sizeof(obj->first));
+	for (j = 0; j < n; j++) {
+		pos = sa[j];
+		b->bwt[j] = (pos > 0) ? data[pos - 1] : 0;
+		obj->first[data[pos] + 1]++;
+	}
+	for (c = 0; c < 256; c++) {
+		obj->first[c + 1] += obj->first[c];
+	}
+
+	// sample every SA_SAMPLE-th position and the start of each text
+	nword = n / 64 + 1;
+	TRY_ALLOC(obj->sampled = corpus_calloc(nword,
+					       sizeof(*obj->sampled)));
+	TRY_ALLOC(obj->sampled_rank = corpus_malloc(nword
+					* sizeof(*obj->sampled_rank)));
+	nsample = 0;
+	for (j = 0; j < n; j++) {
+		pos = sa[j];
+		if (pos % SA_SAMPLE == 0 || data[pos - 1] == 0) {
+			obj->sampled[j / 64] |= ((uint64_t)1) << (j % 64);
+			nsample++;
+		}
+	}
+
+	TRY_ALLOC(obj->sample = corpus_malloc((nsample + 1)
+					      * sizeof(*obj->sample)));
+	k = 0;
+	for (j = 0; j < n; j++) {
+		if (j % 64 == 0) {
+			obj->sampled_rank[j / 64] = k;
+		}
+		if (substring_is_sampled(obj, j)) {
+			obj->sample[k++] = sa[j];
+		}
+	}
+
+	// the wavelet matrix; reuse the text bytes for scratch space
+	corpus_free(b->sa);
+	b->sa = NULL;
+	TRY(substring_wavelet(obj, b->bwt, data));
+
+out:
+	free_context(sctx);
+	CHECK_ERROR(err);
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+static int substring_match_cmp(const void *x1, const void *x2)
+{
+	const struct substring_match *m1 = x1, *m2 = x2;
+
+	if (m1->text_id != m2->text_id) {
+		return (m1->text_id < m2->text_id) ? -1 : +1;
+	} else if (m1->start != m2->start) {
+		return (m1->start < m2->start) ? -1 : +1;
+	} else if (m1->pattern != m2->pattern) {
+		return (m1->pattern < m2->pattern) ? -1 : +1;
+	}
+	return 0;
+}
+
+
+/*
+ * Without an index, count and locate scan each text directly. Texts
+ * without escapes get scanned in place; the others get decoded into a
+ * scratch buffer, along with the raw offset of each decoded byte.
+ */
+
+struct substring_scan {
+	uint8_t *buf;		// scratch for decoding a text with escapes
+	int *buf_raw;		// scratch for the raw offsets
+	const uint8_t *data;	// the current text's decoded bytes
+	const int *raw;		// the raw offset of each decoded byte and
+				// the end, or NULL if the text has no escapes
+	size_t size;		// number of decoded bytes
+};
+
+
+// allocate scratch space for the largest text with escapes; decoding
+// does not make a text longer
+static void substring_scan_init(struct substring_scan *scan,
+				const struct utf8lite_text *text, R_xlen_t n)
+{
+	R_xlen_t i;
+	size_t size, size_max = 0;
+
+	for (i = 0; i < n; i++) {
+		if (text[i].ptr && UTF8LITE_TEXT_HAS_ESC(&text[i])) {
+			size = UTF8LITE_TEXT_SIZE(&text[i]);
+			if (size > size_max) {
+				size_max = size;
+			}
+		}
+	}
+
+	scan->buf = (void *)R_alloc(size_max + 1, 1);
+	scan->buf_raw = (void *)R_alloc(size_max + 1,
+					sizeof(*scan->buf_raw));
+	scan->data = NULL;
+	scan->raw = NULL;
+	scan->size = 0;
+}
+
+
+static void substring_scan_start(struct substring_scan *scan,
+				 const struct utf8lite_text *text)
+{
+	struct utf8lite_text_iter it;
+	const uint8_t *raw;
+	uint8_t *ptr, *end;
+	int *map;
+
+	if (!UTF8LITE_TEXT_HAS_ESC(text)) {
+		scan->data = text->ptr;
+		scan->raw = NULL;
+		scan->size = UTF8LITE_TEXT_SIZE(text);
+		return;
+	}
+
+	ptr = scan->buf;
+	map = scan->buf_raw;
+	utf8lite_text_iter_make(&it, text);
+	raw = text->ptr;
+	while (utf8lite_text_iter_advance(&it)) {
+		end = ptr;
+		utf8lite_encode_utf8(it.current, &end);
+		while (ptr != end) {
+			*map++ = (int)(raw - text->ptr);
+			ptr++;
+		}
+		raw = it.ptr;
+	}
+	*map = (int)UTF8LITE_TEXT_SIZE(text);
+
+	scan->data = scan->buf;
+	scan->raw = scan->buf_raw;
+	scan->size = (size_t)(ptr - scan->buf);
+}
+
+
+// the first occurrence of the pattern at or after 'ptr', or NULL
+static const uint8_t *substring_find(const uint8_t *ptr, const uint8_t *end,
+				     const struct utf8lite_text *pattern)
+{
+	const uint8_t *pat = pattern->ptr;
+	size_t m = UTF8LITE_TEXT_SIZE(pattern);
+
+	while ((size_t)(end - ptr) >= m) {
+		ptr = memchr(ptr, pat[0], (size_t)(end - ptr) - m + 1);
+		if (!ptr) {
+			return NULL;
+		}
+		if (memcmp(ptr + 1, pat + 1, m - 1) == 0) {
+			return ptr;
+		}
+		ptr++;
+	}
+
+	return NULL;
+}
+
+
+// count the occurrences of the patterns in the current text, including
+// overlapping ones; if 'match' is non-NULL, record them there
+static R_xlen_t substring_scan_text(const struct substring_scan *scan,
+				    const struct utf8lite_text *patterns,
+				    R_xlen_t npattern, int text_id,
+				    struct substring_match *match)
+{
+	const uint8_t *ptr, *end = scan->data + scan->size;
+	R_xlen_t count = 0, i;
+
+	for (i = 0; i < npattern; i++) {
+		ptr = scan->data;
+		while ((ptr = substring_find(ptr, end, &patterns[i]))) {
+			if (match) {
+				match[count].text_id = text_id;
+				match[count].start = (int)(ptr - scan->data);
+				match[count].pattern = (int)i;
+			}
+			count++;
+			ptr++;
+		}
+	}
+
+	return count;
+}
+
+
+SEXP text_substring_count(SEXP sx, SEXP sindex, SEXP spatterns)
+{
+	SEXP ans;
+	const struct substring_index *obj;
+	const struct utf8lite_text *text, *patterns;
+	struct substring_scan scan;
+	double *count;
+	R_xlen_t i, n, npattern;
+	int hi, j, lo, nprot = 0;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+	obj = NULL;
+	if (sindex != R_NilValue) {
+		obj = as_substring_index(sindex);
+		if (n != obj->ntext) {
+			Rf_error("text substring index does not match the"
+				 " text");
+		}
+	}
+
+	PROTECT(spatterns = coerce_text(spatterns)); nprot++;
+	patterns = as_text(spatterns, &npattern);
+
+	PROTECT(ans = allocVector(REALSXP, n)); nprot++;
+	setAttrib(ans, R_NamesSymbol, names_text(sx));
+	count = REAL(ans);
+
+	for (i = 0; i < n; i++) {
+		count[i] = text[i].ptr ? 0 : NA_REAL;
+	}
+
+	if (!obj) {
+		substring_scan_init(&scan, text, n);
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (!text[i].ptr) {
+				continue;
+			}
+			substring_scan_start(&scan, &text[i]);
+			count[i] = (double)substring_scan_text(&scan, patterns,
+							       npattern, 0,
+							       NULL);
+		}
+		goto out;
+	}
+
+	for (i = 0; i < npattern; i++) {
+		substring_range(obj, &patterns[i], &lo, &hi);
+
+		for (j = lo; j < hi; j++) {
+			RCORPUS_CHECK_INTERRUPT(j);
+			count[substring_text_id(obj,
+				substring_position(obj, j))] += 1;
+		}
+	}
+
+out:
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+SEXP text_substring_locate(SEXP sx, SEXP sindex, SEXP spatterns)
+{
+	SEXP ans;
+	const struct substring_index *obj;
+	const struct utf8lite_text *text, *patterns;
+	struct substring_match *match;
+	struct substring_scan scan;
+	struct locate loc;
+	struct locate_item *item;
+	const int *raw;
+	R_xlen_t count, i, n, npattern;
+	int begin, end, hi, j, k, lo, nmatch, nprot = 0, pos, text_id;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+	obj = NULL;
+	if (sindex != R_NilValue) {
+		obj = as_substring_index(sindex);
+		if (n != obj->ntext) {
+			Rf_error("text substring index does not match the"
+				 " text");
+		}
+	} else if (n > INT_MAX) {
+		Rf_error("number of texts (%"PRIu64") exceeds maximum (%d)",
+			 (uint64_t)n, INT_MAX);
+	}
+
+	PROTECT(spatterns = coerce_text(spatterns)); nprot++;
+	patterns = as_text(spatterns, &npattern);
+
+	// count the matches, then record their text positions
+	nmatch = 0;
+	if (obj) {
+		for (i = 0; i < npattern; i++) {
+			substring_range(obj, &patterns[i], &lo, &hi);
+			if (hi - lo > INT_MAX - nmatch) {
+				Rf_error("number of matches exceeds"
+					 " maximum (%d)", INT_MAX);
+			}
+			nmatch += hi - lo;
+		}
+	} else {
+		substring_scan_init(&scan, text, n);
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (!text[i].ptr) {
+				continue;
+			}
+			substring_scan_start(&scan, &text[i]);
+			count = substring_scan_text(&scan, patterns, npattern,
+						    (int)i, NULL);
+			if (count > INT_MAX - nmatch) {
+				Rf_error("number of matches exceeds"
+					 " maximum (%d)", INT_MAX);
+			}
+			nmatch += (int)count;
+		}
+	}
+
+	match = (void *)R_alloc(nmatch + 1, sizeof(*match));
+	k = 0;
+	if (obj) {
+		for (i = 0; i < npattern; i++) {
+			substring_range(obj, &patterns[i], &lo, &hi);
+
+			for (j = lo; j < hi; j++) {
+				RCORPUS_CHECK_INTERRUPT(j);
+				pos = substring_position(obj, j);
+				text_id = substring_text_id(obj, pos);
+				match[k].text_id = text_id;
+				match[k].start = pos - obj->start[text_id];
+				match[k].pattern = (int)i;
+				k++;
+			}
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (!text[i].ptr) {
+				continue;
+			}
+			substring_scan_start(&scan, &text[i]);
+			k += (int)substring_scan_text(&scan, patterns, npattern,
+						      (int)i, match + k);
+		}
+	}
+
+	// report the matches in text order, like text_locate
+	qsort(match, nmatch, sizeof(*match), substring_match_cmp);
+
+	loc.items = (void *)R_alloc(nmatch + 1, sizeof(*loc.items));
+	loc.nitem = nmatch;
+	loc.nitem_max = nmatch;
+
+	// map the decoded offsets to raw ones, for the texts with escapes
+	raw = NULL;
+	for (k = 0; k < nmatch; k++) {
+		text_id = match[k].text_id;
+		begin = match[k].start;
+		end = begin + (int)UTF8LITE_TEXT_SIZE(
+					&patterns[match[k].pattern]);
+
+		if (obj) {
+			raw = ((obj->raw_start && obj->raw_start[text_id] >= 0)
+			       ? obj->raw + obj->raw_start[text_id] : NULL);
+		} else if (k == 0 || text_id != match[k - 1].text_id) {
+			substring_scan_start(&scan, &text[text_id]);
+			raw = scan.raw;
+		}
+
+		if (raw) {
+			begin = raw[begin];
+			end = raw[end];
+		}
+
+		item = &loc.items[k];
+		item->text_id = text_id;
+		item->term_id = match[k].pattern;
+		item->instance.ptr = text[text_id].ptr + begin;
+		item->instance.attr = (UTF8LITE_TEXT_BITS(&text[text_id])
+				       | (size_t)(end - begin));
+		item->before = -1;
+		item->after = -1;
+	}
+
+	PROTECT(ans = make_instances(&loc, sx, text)); nprot++;
+
+	UNPROTECT(nprot);
+	return ans;
+}
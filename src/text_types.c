@@ -35,11 +35,13 @@ struct types_context {
 static void types_context_init(struct types_context *ctx, SEXP sx,
 			       SEXP scollapse)
 {
+	const struct token_cache *tokens;
 	const struct utf8lite_text *text;
-	R_xlen_t i, n, g, ngroup;
-	int err = 0;
+	R_xlen_t i, n, g, t, ngroup;
+	int err = 0, type_id;
 
 	text = as_text(sx, &n);
+	tokens = text_token_cache(sx);
 	ctx->filter = text_filter(sx);
 
 	ctx->collapse = LOGICAL(scollapse)[0] == TRUE;
@@ -66,19 +68,15 @@ static void types_context_init(struct types_context *ctx, SEXP sx,
 			continue;
 		}
 
-		TRY(corpus_filter_start(ctx->filter, &text[i]));
-
-		while (corpus_filter_advance(ctx->filter)) {
-			if (ctx->filter->type_id < 0) {
-				// skip ignored and dropped tokens
+		for (t = tokens->offset[i]; t < tokens->offset[i + 1]; t++) {
+			type_id = tokens->type_id[t];
+			if (type_id < 0) {
+				// skip dropped tokens
 				continue;
 			}
 
-			TRY(corpus_intset_add(&ctx->types[g],
-					      ctx->filter->type_id, NULL));
+			TRY(corpus_intset_add(&ctx->types[g], type_id, NULL));
 		}
-
-		TRY(ctx->filter->error);
 	}
 out:
 	if (err) {
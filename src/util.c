@@ -78,3 +78,25 @@ double *as_weights(SEXP sweights, R_xlen_t n)
 
 	return REAL(sweights);
 }
+
+
+int as_nthread(SEXP sthreads, R_xlen_t nwork)
+{
+	int nthread = 1;
+
+#ifdef _OPENMP
+	if (sthreads != R_NilValue) {
+		nthread = INTEGER(sthreads)[0];
+	}
+#endif
+
+	if ((R_xlen_t)nthread > nwork) {
+		nthread = (int)nwork;
+	}
+
+	if (nthread < 1) {
+		nthread = 1;
+	}
+
+	return nthread;
+}